@@ -1,6 +1,10 @@
+#define _GNU_SOURCE
 #include "args.h"
 #include <argp.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "defines.h"
 
@@ -14,6 +18,25 @@ Example usage on the outside:\n \
     udp-tunnel -l 9999";
 static char args_doc[] = "";
 
+// keys for options that have no short form
+enum {
+    OPT_THREADS = 0x100,
+    OPT_STEER,
+    OPT_CPUS,
+    OPT_URING,
+    OPT_GSO,
+    OPT_MUX,
+    OPT_SPARES,
+    OPT_QUEUE,
+    OPT_MAX_CONNS,
+    OPT_METRICS,
+    OPT_XDP,
+    OPT_XDP_GENERIC,
+    OPT_CONNECTED,
+    OPT_RESOLVE,
+    OPT_SQPOLL
+};
+
 static struct argp_option options[] = {
     {
         .group = 1,
@@ -33,6 +56,20 @@ static struct argp_option options[] = {
         .group = 1,
         .doc = "address of the inside service"
     },
+    {
+        .name = "spares",
+        .arg = "count",
+        .key = OPT_SPARES,
+        .group = 1,
+        .doc = "number of unused tunnels kept open for new clients (default 1)"
+    },
+    {
+        .name = "resolve",
+        .arg = "seconds",
+        .key = OPT_RESOLVE,
+        .group = 1,
+        .doc = "look up the outside host name again at least this often, sooner when the TTL of its DNS record runs out, and move the tunnels over when the address changed (default 300, 0 to resolve it only once)"
+    },
     {
         .group = 2,
         .doc = "Options for running it as the outside agent:"
@@ -44,6 +81,50 @@ static struct argp_option options[] = {
         .group = 2,
         .doc = "listen port"
     },
+    {
+        .name = "steer",
+        .key = OPT_STEER,
+        .group = 2,
+        .doc = "attach a BPF program that steers each source address to a fixed worker thread"
+    },
+    {
+        .name = "uring",
+        .key = OPT_URING,
+        .group = 2,
+        .doc = "use the io_uring datapath (needs a build with 'make uring=1')"
+    },
+    {
+        .name = "sqpoll",
+        .key = OPT_SQPOLL,
+        .group = 2,
+        .doc = "with --uring, let a kernel thread per worker poll for the datagrams to send, so a busy worker needs no system calls at all (costs a CPU while there is traffic)"
+    },
+    {
+        .name = "queue",
+        .arg = "count",
+        .key = OPT_QUEUE,
+        .group = 2,
+        .doc = "number of datagrams of new clients to hold while no spare tunnel is available (default 256, 0 to drop them)"
+    },
+    {
+        .name = "connected",
+        .key = OPT_CONNECTED,
+        .group = 2,
+        .doc = "give every client and its tunnel their own sockets, connected to them, as soon as they are paired. The kernel then sorts the datagrams by flow (pays off with Linux 6.13 or later)"
+    },
+    {
+        .name = "xdp",
+        .arg = "interface",
+        .key = OPT_XDP,
+        .group = 2,
+        .doc = "attach an XDP program to the interface the datagrams arrive on, it forwards the datagrams of established clients in the kernel"
+    },
+    {
+        .name = "xdp-generic",
+        .key = OPT_XDP_GENERIC,
+        .group = 2,
+        .doc = "attach the XDP program in generic mode, for drivers without (complete) XDP support"
+    },
     {
         .group = 3,
         .doc = "General options:"
@@ -62,6 +143,54 @@ static struct argp_option options[] = {
         .group = 3,
         .doc = "keepalive interval in seconds (default 25, must be the same on boths sides)"
     },
+    {
+        .name = "batch",
+        .arg = "count",
+        .key = 'b',
+        .group = 3,
+        .doc = "max number of datagrams received and sent per system call (default 32). The inside agent takes at most that many from one socket before it serves the next one"
+    },
+    {
+        .name = "threads",
+        .arg = "count",
+        .key = OPT_THREADS,
+        .group = 3,
+        .doc = "number of worker threads (default 1). The outside agent gives each its own SO_REUSEPORT socket, the inside agent distributes the client connections among them"
+    },
+    {
+        .name = "cpus",
+        .arg = "list",
+        .key = OPT_CPUS,
+        .group = 3,
+        .doc = "comma separated list of CPUs to pin the worker threads to, worker n is pinned to the n-th entry (modulo the list length)"
+    },
+    {
+        .name = "gso",
+        .key = OPT_GSO,
+        .group = 3,
+        .doc = "receive trains of same sized datagrams as one buffer (UDP_GRO) and forward them in one piece (UDP_SEGMENT)"
+    },
+    {
+        .name = "max-conns",
+        .arg = "count",
+        .key = OPT_MAX_CONNS,
+        .group = 3,
+        .doc = "allocate the connection table for count entries at startup and never grow it, new connections are refused when it is full (default: grow as needed)"
+    },
+    {
+        .name = "mux",
+        .arg = "count",
+        .key = OPT_MUX,
+        .group = 3,
+        .doc = "multiplex all clients over a fixed set of tunnels, prefixing every datagram with a flow ID. The inside agent opens count tunnels, the outside agent only needs a nonzero count (must be used on both sides)"
+    },
+    {
+        .name = "metrics",
+        .arg = "path",
+        .key = OPT_METRICS,
+        .group = 3,
+        .doc = "serve counters in the Prometheus text format on a Unix domain socket at path"
+    },
 
     {0}
 };    
@@ -86,6 +215,89 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state){
             sscanf(arg, "%m[^:]:%d", &parsed->outside_host, &parsed->outside_port);
             break;
 
+        case 'b':
+            parsed->batch = strtoul(arg, NULL, 10);
+            break;
+
+        case OPT_THREADS:
+            parsed->threads = strtoul(arg, NULL, 10);
+            break;
+
+        case OPT_CPUS:
+            parsed->cpu_count = 0;
+            for (char* p = arg; p != NULL; p = strchr(p, ',')) {
+                if (*p == ',') {
+                    ++p;
+                }
+                char* end;
+                unsigned long cpu = strtoul(p, &end, 10);
+                if ((end == p) || ((*end != ',') && (*end != '\0'))) {
+                    argp_error(state, "--cpus must be a comma separated list of CPU numbers");
+                }
+                if ((cpu >= CPU_SETSIZE) || (cpu >= (unsigned long)sysconf(_SC_NPROCESSORS_CONF))) {
+                    argp_error(state, "--cpus: there is no CPU %lu", cpu);
+                }
+                unsigned* cpus = realloc(parsed->cpus, (parsed->cpu_count + 1) * sizeof(unsigned));
+                if (cpus == NULL) {
+                    argp_error(state, "--cpus: out of memory");
+                }
+                parsed->cpus = cpus;
+                parsed->cpus[parsed->cpu_count++] = cpu;
+            }
+            break;
+
+        case OPT_STEER:
+            parsed->steer = true;
+            break;
+
+        case OPT_URING:
+            parsed->uring = true;
+            break;
+
+        case OPT_SQPOLL:
+            parsed->sqpoll = true;
+            break;
+
+        case OPT_GSO:
+            parsed->gso = true;
+            break;
+
+        case OPT_SPARES:
+            parsed->spares = strtoul(arg, NULL, 10);
+            break;
+
+        case OPT_QUEUE:
+            parsed->queue = strtoul(arg, NULL, 10);
+            break;
+
+        case OPT_MAX_CONNS:
+            parsed->max_conns = strtoul(arg, NULL, 10);
+            break;
+
+        case OPT_METRICS:
+            parsed->metrics = arg;
+            break;
+
+        case OPT_XDP:
+            parsed->xdp = arg;
+            break;
+
+        case OPT_XDP_GENERIC:
+            parsed->xdp_generic = true;
+            break;
+
+        case OPT_CONNECTED:
+            parsed->connected = true;
+            break;
+
+        case OPT_RESOLVE:
+            parsed->resolve = strtoul(arg, NULL, 10);
+            break;
+
+        case OPT_MUX:
+            parsed->mux = strtoul(arg, NULL, 10);
+            break;
+
         case 'k':
             parsed->secret = arg;
             break;
@@ -120,7 +332,24 @@ args_parsed_t args_parse(int argc, char* args[]) {
     parsed.service = NULL;
     parsed.outside = NULL;
     parsed.secret = NULL;
+    parsed.metrics = NULL;
+    parsed.xdp = NULL;
+    parsed.xdp_generic = false;
+    parsed.connected = false;
     parsed.keepalive = 25;
+    parsed.batch = 32;
+    parsed.threads = 1;
+    parsed.cpus = NULL;
+    parsed.cpu_count = 0;
+    parsed.steer = false;
+    parsed.uring = false;
+    parsed.sqpoll = false;
+    parsed.gso = false;
+    parsed.mux = 0;
+    parsed.spares = 1;
+    parsed.resolve = 300;
+    parsed.queue = 256;
+    parsed.max_conns = 0;
     argp_parse(&argp, argc, args, 0, 0, &parsed);
 
     if ((parsed.listenport > 0) && (parsed.outside != NULL)) {
@@ -135,6 +364,47 @@ args_parsed_t args_parse(int argc, char* args[]) {
     if ((parsed.listenport == 0) && (parsed.outside == NULL) && (parsed.service == 0)) {
         error("too few options");
     }
+    if ((parsed.batch == 0) || (parsed.batch > 1024)) {
+        error("--batch must be between 1 and 1024");
+    }
+    if ((parsed.threads == 0) || (parsed.threads > 256)) {
+        error("--threads must be between 1 and 256");
+    }
+#ifndef HAVE_URING
+    if (parsed.uring) {
+        error("--uring is not available, rebuild with 'make uring=1'");
+    }
+#endif
+    if (parsed.sqpoll && !parsed.uring) {
+        error("--sqpoll needs --uring");
+    }
+    if (parsed.uring && (parsed.listenport == 0)) {
+        error("--uring is only supported by the outside agent");
+    }
+    if ((parsed.spares == 0) || (parsed.spares > 1024)) {
+        error("--spares must be between 1 and 1024");
+    }
+    if (parsed.queue > 65536) {
+        error("--queue must be between 0 and 65536");
+    }
+    if (parsed.mux > 64) {
+        error("--mux must be between 1 and 64");
+    }
+    if (parsed.mux && (parsed.gso || parsed.uring)) {
+        error("--mux can not be combined with --gso or --uring");
+    }
+    if (parsed.xdp && (parsed.listenport == 0)) {
+        error("--xdp is only supported by the outside agent");
+    }
+    if (parsed.xdp && parsed.mux) {
+        error("--xdp can not be combined with --mux");
+    }
+    if (parsed.connected && (parsed.listenport == 0)) {
+        error("--connected is only supported by the outside agent");
+    }
+    if (parsed.connected && (parsed.mux || parsed.uring)) {
+        error("--connected can not be combined with --mux or --uring");
+    }
     if (parsed.service && (parsed.service_port == 0)) {
         error("something is wrong with the service address, use host:port syntax");
     }
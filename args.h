@@ -1,6 +1,8 @@
 #ifndef ARGS_H
 #define ARGS_H
 
+#include <stdbool.h>
+
 typedef struct {
     unsigned  listenport;
     char* service;
@@ -10,7 +12,24 @@ typedef struct {
     char* outside_host;
     unsigned outside_port;
     char* secret;
+    char* metrics;
+    char* xdp;
     unsigned keepalive;
+    unsigned batch;
+    unsigned threads;
+    unsigned* cpus;
+    unsigned cpu_count;
+    unsigned mux;
+    unsigned spares;
+    unsigned resolve;
+    unsigned queue;
+    unsigned max_conns;
+    bool steer;
+    bool uring;
+    bool sqpoll;
+    bool gso;
+    bool xdp_generic;
+    bool connected;
 } args_parsed_t;
 
 args_parsed_t args_parse(int argc, char* args[]);
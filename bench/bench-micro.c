@@ -0,0 +1,368 @@
+/**
+ * @file bench-micro.c
+ * @brief microbenchmarks of the building blocks
+ *
+ * Measures the connection table (lookups, insert/remove churn, expiry),
+ * the keepalive authentication and SHA-256 in isolation, linked against
+ * the same object files as the agent. Every benchmark gets one untimed
+ * warm-up run and then a number of timed repetitions, the results go to
+ * stdout as CSV, one line per benchmark and parameter:
+ *
+ * - param is the table size for the connection table and the input size
+ *   for SHA-256
+ * - *_ns_per_op are over the repetitions, mops is from the median
+ * - bytes_per_cycle counts TSC cycles, only for benchmarks that hash
+ *
+ * Build and run it with `make bench-micro`, `-f name` runs only the
+ * benchmarks whose name contains name.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "connlist.h"
+#include "defines.h"
+#include "mac.h"
+#include "misc.h"
+#include "sha-256.h"
+#include "wheel.h"
+
+#define MAX_REPS 64
+#define LOOKUPS (1 << 20)
+
+typedef void (*bench_fn_t)(unsigned param, unsigned ops);
+
+static unsigned reps = 5;
+static const char* filter = NULL;
+static FILE* csv;
+static volatile uint8_t sink;
+
+static uint64_t timer_ns;
+static uint64_t timer_cycles;
+static uint64_t timer_start_ns;
+static uint64_t timer_start_cycles;
+
+static uint64_t nanosec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * the benchmarks call these around the part that is measured, the setup
+ * of a repetition stays outside
+ */
+static void timer_start(void) {
+    timer_start_ns = nanosec();
+    timer_start_cycles = cycles();
+}
+
+static void timer_stop(void) {
+    timer_cycles += cycles() - timer_start_cycles;
+    timer_ns += nanosec() - timer_start_ns;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * run one benchmark and write its CSV line
+ *
+ * @param name name of the benchmark
+ * @param param table or input size, passed on to the benchmark
+ * @param impl SHA-256 implementation in use or "-"
+ * @param fn the benchmark, it runs ops operations per repetition
+ * @param ops operations per repetition
+ * @param bytes bytes hashed per operation, 0 if nothing is hashed
+ */
+static void run(const char* name, unsigned param, const char* impl, bench_fn_t fn, unsigned ops, size_t bytes) {
+    double ns[MAX_REPS];
+    double per_cycle[MAX_REPS];
+
+    if (filter && !strstr(name, filter)) {
+        return;
+    }
+    fn(param, ops);
+    for (unsigned r = 0; r < reps; ++r) {
+        timer_ns = 0;
+        timer_cycles = 0;
+        fn(param, ops);
+        ns[r] = (double)timer_ns / ops;
+        per_cycle[r] = timer_cycles ? (double)bytes * ops / timer_cycles : 0;
+    }
+    qsort(ns, reps, sizeof(double), cmp_double);
+    qsort(per_cycle, reps, sizeof(double), cmp_double);
+    fprintf(csv, "%s,%u,%s,%u,%u,%.2f,%.2f,%.2f,%.3f,", name, param, impl, reps, ops,
+        ns[reps / 2], ns[0], ns[reps - 1], 1e3 / ns[reps / 2]);
+    if (bytes && per_cycle[reps / 2]) {
+        fprintf(csv, "%.3f", per_cycle[reps / 2]);
+    }
+    fprintf(csv, "\n");
+    fflush(csv);
+}
+
+/*
+ * connection table
+ */
+
+static timer_wheel_t wheel;
+static conn_entry_t** entries = NULL;
+static struct sockaddr_in* addrs = NULL;
+static unsigned* order = NULL;
+static unsigned next_addr = 0;
+
+/**
+ * a distinct address for every n, clients, tunnels and addresses that are
+ * never in the table get different networks
+ */
+static struct sockaddr_in make_addr(uint8_t net, unsigned n) {
+    struct sockaddr_in a = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl((uint32_t)net << 24 | (n >> 8)),
+        .sin_port = htons(1024 + (n & 0xff))
+    };
+    return a;
+}
+
+/**
+ * fill the table with n active entries, each with a client and a tunnel
+ * address, and prepare a random order of lookups among them
+ */
+static void table_fill(unsigned n) {
+    conn_lock();
+    for (unsigned i = 0; i < n; ++i) {
+        struct sockaddr_in tunnel = make_addr(11, next_addr);
+        addrs[i] = make_addr(10, next_addr++);
+        entries[i] = conn_table_insert();
+        conn_set_client_address(entries[i], &addrs[i]);
+        conn_set_tunnel_address(entries[i], &tunnel);
+    }
+    conn_unlock();
+    for (unsigned i = 0; i < LOOKUPS; ++i) {
+        order[i] = rand() % n;
+    }
+}
+
+static void table_empty(unsigned n) {
+    conn_lock();
+    for (unsigned i = 0; i < n; ++i) {
+        if (entries[i]->used) {
+            conn_table_remove(entries[i]);
+        }
+    }
+    conn_unlock();
+}
+
+static void bench_find_client(unsigned n, unsigned ops) {
+    table_fill(n);
+    conn_lock();
+    timer_start();
+    for (unsigned i = 0; i < ops; ++i) {
+        sink ^= conn_table_find_client_address(&addrs[order[i % LOOKUPS]])->used;
+    }
+    timer_stop();
+    conn_unlock();
+    table_empty(n);
+}
+
+static void bench_find_tunnel(unsigned n, unsigned ops) {
+    table_fill(n);
+    conn_lock();
+    timer_start();
+    for (unsigned i = 0; i < ops; ++i) {
+        sink ^= conn_table_find_tunnel_address(&entries[order[i % LOOKUPS]]->addr_tunnel)->used;
+    }
+    timer_stop();
+    conn_unlock();
+    table_empty(n);
+}
+
+static void bench_find_miss(unsigned n, unsigned ops) {
+    table_fill(n);
+    conn_lock();
+    timer_start();
+    for (unsigned i = 0; i < ops; ++i) {
+        struct sockaddr_in a = make_addr(12, order[i % LOOKUPS]);
+        sink ^= (conn_table_find_client_address(&a) != NULL);
+    }
+    timer_stop();
+    conn_unlock();
+    table_empty(n);
+}
+
+/**
+ * the table stays at n entries, every operation removes a random one and
+ * inserts a new client in its place
+ */
+static void bench_churn(unsigned n, unsigned ops) {
+    table_fill(n);
+    conn_lock();
+    timer_start();
+    for (unsigned i = 0; i < ops; ++i) {
+        unsigned k = order[i % LOOKUPS];
+        conn_table_remove(entries[k]);
+        addrs[k] = make_addr(10, next_addr++);
+        entries[k] = conn_table_insert();
+        conn_set_client_address(entries[k], &addrs[k]);
+    }
+    timer_stop();
+    conn_unlock();
+    table_empty(n);
+}
+
+/**
+ * let the expiry timers remove n inactive entries. The entries are made
+ * to look inactive and the wheel is advanced past their deadline, the
+ * removal itself runs exactly like in the agents, including its log lines.
+ */
+static void bench_expire(unsigned n, unsigned ops) {
+    (void)ops;
+    wheel_init(&wheel, clock_update());
+    table_fill(n);
+    for (unsigned i = 0; i < n; ++i) {
+        entries[i]->last_acticity = 0;
+    }
+    conn_lock();
+    timer_start();
+    wheel_advance(&wheel, clock_now() + CONN_LIFETIME_SECONDS * 1000 + 2);
+    timer_stop();
+    conn_unlock();
+    table_empty(n);
+}
+
+/*
+ * authentication and hashing
+ */
+
+static uint64_t nonce = 1;
+static mac_t* macs = NULL;
+static bool* valid = NULL;
+
+static void bench_mac_gen(unsigned param, unsigned ops) {
+    (void)param;
+    timer_start();
+    for (unsigned i = 0; i < ops; ++i) {
+        sink ^= mac_gen(NULL, 0, nonce++).hash[0];
+    }
+    timer_stop();
+}
+
+static void bench_mac_test(unsigned param, unsigned ops) {
+    (void)param;
+    for (unsigned i = 0; i < ops; ++i) {
+        macs[i] = mac_gen(NULL, 0, nonce++);
+    }
+    timer_start();
+    for (unsigned i = 0; i < ops; ++i) {
+        sink ^= mac_test(NULL, 0, macs[i]);
+    }
+    timer_stop();
+}
+
+static void bench_mac_check(unsigned param, unsigned ops) {
+    for (unsigned i = 0; i < ops; ++i) {
+        macs[i] = mac_gen(NULL, 0, nonce++);
+    }
+    timer_start();
+    for (unsigned i = 0; i < ops; i += param) {
+        mac_check_keepalives(macs + i, (ops - i < param) ? ops - i : param, valid + i);
+    }
+    timer_stop();
+    sink ^= valid[0];
+}
+
+static uint8_t* data = NULL;
+
+static void bench_sha(unsigned size, unsigned ops) {
+    uint8_t hash[SIZE_OF_SHA_256_HASH];
+    timer_start();
+    for (unsigned i = 0; i < ops; ++i) {
+        calc_sha_256(hash, data, size);
+        sink ^= hash[0];
+    }
+    timer_stop();
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: bench-micro [options]\n"
+        "  -r count  timed repetitions per benchmark (default 5)\n"
+        "  -f name   only run benchmarks whose name contains name\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    static const unsigned table_sizes[] = {10, 100, 1000, 10000, 100000};
+    static const unsigned sha_sizes[] = {40, 64, 1500, 65536};
+    static const char* secret = "correct horse battery staple";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:f:h")) != -1) {
+        switch (opt) {
+            case 'r': reps = strtoul(optarg, NULL, 10); break;
+            case 'f': filter = optarg; break;
+            default: usage();
+        }
+    }
+    if ((reps == 0) || (reps > MAX_REPS)) {
+        usage();
+    }
+
+    // the connection table logs its removals to stdout, the results go to the original stdout
+    csv = fdopen(dup(STDOUT_FILENO), "w");
+    if (!freopen("/dev/null", "w", stdout)) {
+        return EXIT_FAILURE;
+    }
+
+    entries = calloc(100000, sizeof(conn_entry_t*));
+    addrs = calloc(100000, sizeof(struct sockaddr_in));
+    order = calloc(LOOKUPS, sizeof(unsigned));
+    macs = calloc(1 << 16, sizeof(mac_t));
+    valid = calloc(1 << 16, sizeof(bool));
+    data = calloc(1, 65536);
+    wheel_init(&wheel, clock_update());
+    conn_table_set_worker(-1, &wheel);
+    conn_table_set_lifetime(CONN_LIFETIME_SECONDS, true);
+    mac_init(secret, strlen(secret));
+
+    fprintf(csv, "benchmark,param,impl,reps,ops,median_ns_per_op,min_ns_per_op,max_ns_per_op,mops,bytes_per_cycle\n");
+    for (unsigned i = 0; i < sizeof(table_sizes) / sizeof(table_sizes[0]); ++i) {
+        unsigned n = table_sizes[i];
+        run("conn_find_client_address", n, "-", bench_find_client, 1 << 20, 0);
+        run("conn_find_tunnel_address", n, "-", bench_find_tunnel, 1 << 20, 0);
+        run("conn_find_client_miss", n, "-", bench_find_miss, 1 << 20, 0);
+        run("conn_insert_remove", n, "-", bench_churn, 1 << 18, 0);
+        run("conn_expire", n, "-", bench_expire, n, 0);
+    }
+    for (enum sha_256_impl impl = SHA_256_IMPL_SCALAR; impl <= SHA_256_IMPL_SHANI; ++impl) {
+        if (sha_256_select(impl) != impl) {
+            continue;
+        }
+        run("mac_gen", 0, sha_256_impl_name(), bench_mac_gen, 1 << 18, 0);
+        run("mac_test", 0, sha_256_impl_name(), bench_mac_test, 1 << 16, 0);
+        run("mac_check_keepalives", 32, sha_256_impl_name(), bench_mac_check, 1 << 16, 0);
+        for (unsigned i = 0; i < sizeof(sha_sizes) / sizeof(sha_sizes[0]); ++i) {
+            unsigned size = sha_sizes[i];
+            run("calc_sha_256", size, sha_256_impl_name(), bench_sha, (16 << 20) / (size + 64), size);
+        }
+    }
+    return 0;
+}
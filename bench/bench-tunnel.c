@@ -0,0 +1,424 @@
+/**
+ * @file bench-tunnel.c
+ * @brief end-to-end benchmark of both agents on loopback
+ *
+ * Starts an outside and an inside agent on 127.0.0.1 together with a UDP
+ * echo service, then lets a number of client flows send datagrams through
+ * the tunnel and back. Every combination of the swept parameters is one
+ * run with fresh agents and one CSV line on stdout:
+ *
+ * - pps and Mbit/s count round trips and their payload in one direction
+ * - rtt_* are percentiles of the round trip time of the datagrams
+ * - setup_* is the time from the first datagram of a new client to its
+ *   first echo, measured one client after another before the load starts
+ * - cpu_*_ns is the CPU time (user and system) each agent used during the
+ *   load phase, per round trip
+ * - lost is the number of datagrams that were given up on after a stall
+ *
+ * Build and run it with `make bench`, see the Makefile for the sweeps.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define KEY "bench"
+#define ECHO_BATCH 64
+#define SETUP_TIMEOUT_MS 2000
+#define STALL_MS 100
+#define MAX_LIST 16
+
+typedef struct {
+    unsigned values[MAX_LIST];
+    unsigned count;
+} list_t;
+
+static const char* binary = "./udp-tunnel";
+static list_t clients = {{1, 16, 64}, 3};
+static list_t sizes = {{64, 512, 1400}, 3};
+static list_t keepalives = {{25}, 1};
+static unsigned duration = 2;
+static unsigned window = 4;
+static char* outside_args = NULL;
+static char* inside_args = NULL;
+
+static int echo_sock;
+static volatile bool echo_running;
+
+static uint64_t nanosec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void parse_list(list_t* l, const char* s) {
+    l->count = 0;
+    for (const char* p = s; p && *p && (l->count < MAX_LIST); p = strchr(p, ',')) {
+        if (*p == ',') {
+            ++p;
+        }
+        l->values[l->count++] = strtoul(p, NULL, 10);
+    }
+}
+
+static int udp_socket(uint16_t port, bool nonblock) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(port)
+    };
+    int sock = socket(AF_INET, SOCK_DGRAM | (nonblock ? SOCK_NONBLOCK : 0), 0);
+    if ((sock < 0) || (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)) {
+        perror("could not create UDP socket");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
+
+static uint16_t local_port(int sock) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(sock, (struct sockaddr*)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * a port that was free a moment ago, for the outside agent to listen on
+ */
+static uint16_t free_port(void) {
+    int sock = udp_socket(0, false);
+    uint16_t port = local_port(sock);
+    close(sock);
+    return port;
+}
+
+/**
+ * the service: send every datagram back to where it came from
+ */
+static void* run_echo(void* arg) {
+    (void)arg;
+    static char bufs[ECHO_BATCH][2048];
+    struct mmsghdr msgs[ECHO_BATCH];
+    struct iovec iovs[ECHO_BATCH];
+    struct sockaddr_in addrs[ECHO_BATCH];
+    struct timeval timeout = {
+        .tv_usec = 100000
+    };
+    setsockopt(echo_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (echo_running) {
+        for (int i = 0; i < ECHO_BATCH; ++i) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = sizeof(bufs[i]);
+            msgs[i].msg_hdr = (struct msghdr) {
+                .msg_name = &addrs[i],
+                .msg_namelen = sizeof(addrs[i]),
+                .msg_iov = &iovs[i],
+                .msg_iovlen = 1
+            };
+        }
+        int n = recvmmsg(echo_sock, msgs, ECHO_BATCH, MSG_WAITFORONE, NULL);
+        for (int i = 0; i < n; ++i) {
+            iovs[i].iov_len = msgs[i].msg_len;
+        }
+        for (int sent = 0; sent < n;) {
+            int k = sendmmsg(echo_sock, msgs + sent, n - sent, 0);
+            sent += (k > 0) ? k : 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * start an agent with the given arguments followed by the extra arguments
+ * from the command line, its output goes to /dev/null
+ */
+static pid_t start_agent(char** argv, char* extra) {
+    char* all[64];
+    int n = 0;
+    all[n++] = (char*)binary;
+    while (*argv) {
+        all[n++] = *argv++;
+    }
+    char* copy = extra ? strdup(extra) : NULL;
+    for (char* tok = copy ? strtok(copy, " ") : NULL; tok && (n < 63); tok = strtok(NULL, " ")) {
+        all[n++] = tok;
+    }
+    all[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(binary, all);
+        _exit(127);
+    }
+    free(copy);
+    return pid;
+}
+
+static void stop_agent(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/**
+ * CPU time used by a process so far, in nanoseconds
+ */
+static uint64_t cpu_time(pid_t pid) {
+    char path[64];
+    char buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = 0;
+
+    // skip pid and the command name, which may contain spaces, utime and stime are fields 14 and 15
+    char* p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)) {
+        return 0;
+    }
+    return (uint64_t)(utime + stime) * 1000000000ULL / sysconf(_SC_CLK_TCK);
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t* sorted, size_t count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (count - 1) + 0.5);
+    return sorted[i] / 1e3;
+}
+
+/**
+ * send the first datagram of a new client and wait for its echo
+ *
+ * @return setup time in nanoseconds, 0 on timeout
+ */
+static uint64_t setup_client(int sock, struct sockaddr_in* dest) {
+    char buf[64] = "hello";
+    uint64_t start = nanosec();
+    uint64_t next_send = 0;
+    while (nanosec() - start < SETUP_TIMEOUT_MS * 1000000ULL) {
+        if (nanosec() >= next_send) {
+            sendto(sock, buf, 5, 0, (struct sockaddr*)dest, sizeof(*dest));
+            next_send = nanosec() + 200000000ULL;
+        }
+        struct pollfd pfd = {
+            .fd = sock,
+            .events = POLLIN
+        };
+        if ((poll(&pfd, 1, 10) > 0) && (recv(sock, buf, sizeof(buf), 0) > 0)) {
+            return nanosec() - start;
+        }
+    }
+    return 0;
+}
+
+static void send_probe(int sock, struct sockaddr_in* dest, char* buf, unsigned size) {
+    uint64_t now = nanosec();
+    memcpy(buf, &now, sizeof(now));
+    sendto(sock, buf, size, 0, (struct sockaddr*)dest, sizeof(*dest));
+}
+
+static void run(unsigned count, unsigned size, unsigned keepalive) {
+    char ka[16], listen_port[16], service[32], outside[32];
+    uint16_t port = free_port();
+
+    echo_sock = udp_socket(0, false);
+    echo_running = true;
+    pthread_t echo_thread;
+    pthread_create(&echo_thread, NULL, run_echo, NULL);
+
+    snprintf(ka, sizeof(ka), "%u", keepalive);
+    snprintf(listen_port, sizeof(listen_port), "%u", port);
+    snprintf(service, sizeof(service), "127.0.0.1:%u", local_port(echo_sock));
+    snprintf(outside, sizeof(outside), "127.0.0.1:%u", port);
+    char* argv_out[] = {"-l", listen_port, "-k", KEY, "-t", ka, NULL};
+    char* argv_in[] = {"-s", service, "-o", outside, "-k", KEY, "-t", ka, NULL};
+    pid_t pid_out = start_agent(argv_out, outside_args);
+    usleep(200000);
+    pid_t pid_in = start_agent(argv_in, inside_args);
+    usleep(300000);
+
+    struct sockaddr_in dest = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(port)
+    };
+    int* socks = calloc(count, sizeof(int));
+    unsigned* outstanding = calloc(count, sizeof(unsigned));
+    struct pollfd* pfds = calloc(count, sizeof(struct pollfd));
+    char* buf = calloc(1, size < 64 ? 64 : size);
+
+    // new clients one after another, each has to wait for its tunnel
+    uint64_t setup_sum = 0, setup_max = 0;
+    unsigned setup_ok = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        socks[i] = udp_socket(0, true);
+        pfds[i].fd = socks[i];
+        pfds[i].events = POLLIN;
+        uint64_t t = setup_client(socks[i], &dest);
+        if (t) {
+            setup_sum += t;
+            setup_max = (t > setup_max) ? t : setup_max;
+            ++setup_ok;
+        }
+    }
+
+    // closed loop load, every flow keeps a window of datagrams in flight
+    size_t samples_size = 1 << 20, samples_count = 0;
+    uint64_t* samples = malloc(samples_size * sizeof(uint64_t));
+    uint64_t bytes = 0, lost = 0;
+    uint64_t cpu_out = cpu_time(pid_out);
+    uint64_t cpu_in = cpu_time(pid_in);
+    uint64_t start = nanosec();
+    uint64_t end = start + duration * 1000000000ULL;
+    for (unsigned i = 0; i < count; ++i) {
+        for (unsigned k = 0; k < window; ++k) {
+            send_probe(socks[i], &dest, buf, size);
+        }
+        outstanding[i] = window;
+    }
+    while (nanosec() < end) {
+        int ready = poll(pfds, count, STALL_MS);
+        if (ready == 0) {
+            // nothing came back for a while, give up on what is in flight and start over
+            for (unsigned i = 0; i < count; ++i) {
+                lost += outstanding[i];
+                for (unsigned k = 0; k < window; ++k) {
+                    send_probe(socks[i], &dest, buf, size);
+                }
+                outstanding[i] = window;
+            }
+            continue;
+        }
+        for (unsigned i = 0; (i < count) && (ready > 0); ++i) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            --ready;
+            ssize_t n;
+            uint64_t sent;
+            while ((n = recv(socks[i], buf, size, 0)) >= (ssize_t)sizeof(sent)) {
+                memcpy(&sent, buf, sizeof(sent));
+                if (samples_count == samples_size) {
+                    samples_size *= 2;
+                    samples = realloc(samples, samples_size * sizeof(uint64_t));
+                }
+                samples[samples_count++] = nanosec() - sent;
+                bytes += n;
+                if (outstanding[i]) {
+                    --outstanding[i];
+                }
+                if (nanosec() < end) {
+                    send_probe(socks[i], &dest, buf, size);
+                    ++outstanding[i];
+                }
+            }
+        }
+    }
+    double elapsed = (nanosec() - start) / 1e9;
+    cpu_out = cpu_time(pid_out) - cpu_out;
+    cpu_in = cpu_time(pid_in) - cpu_in;
+
+    qsort(samples, samples_count, sizeof(uint64_t), cmp_u64);
+    printf("%u,%u,%u,%.0f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%u,%.0f,%.0f,%lu\n",
+        count, size, keepalive,
+        samples_count / elapsed, bytes * 8 / elapsed / 1e6,
+        percentile_us(samples, samples_count, 0.5), percentile_us(samples, samples_count, 0.9),
+        percentile_us(samples, samples_count, 0.99), percentile_us(samples, samples_count, 1.0),
+        setup_ok ? setup_sum / 1e3 / setup_ok : 0, setup_max / 1e3, count - setup_ok,
+        samples_count ? (double)cpu_out / samples_count : 0, samples_count ? (double)cpu_in / samples_count : 0,
+        lost);
+    fflush(stdout);
+
+    stop_agent(pid_in);
+    stop_agent(pid_out);
+    echo_running = false;
+    pthread_join(echo_thread, NULL);
+    close(echo_sock);
+    for (unsigned i = 0; i < count; ++i) {
+        close(socks[i]);
+    }
+    free(samples);
+    free(socks);
+    free(outstanding);
+    free(pfds);
+    free(buf);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: bench-tunnel [options] [binary]\n"
+        "  -c list   comma separated client counts (default 1,16,64)\n"
+        "  -s list   comma separated payload sizes (default 64,512,1400)\n"
+        "  -k list   comma separated keepalive intervals in seconds (default 25)\n"
+        "  -d secs   duration of the load phase of each run (default 2)\n"
+        "  -w count  datagrams in flight per client (default 4)\n"
+        "  -O args   extra arguments for the outside agent\n"
+        "  -I args   extra arguments for the inside agent\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:k:d:w:O:I:h")) != -1) {
+        switch (opt) {
+            case 'c': parse_list(&clients, optarg); break;
+            case 's': parse_list(&sizes, optarg); break;
+            case 'k': parse_list(&keepalives, optarg); break;
+            case 'd': duration = strtoul(optarg, NULL, 10); break;
+            case 'w': window = strtoul(optarg, NULL, 10); break;
+            case 'O': outside_args = optarg; break;
+            case 'I': inside_args = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind < argc) {
+        binary = argv[optind];
+    }
+    if (access(binary, X_OK) != 0) {
+        fprintf(stderr, "agent binary '%s' not found\n", binary);
+        usage();
+    }
+    for (unsigned i = 0; i < sizes.count; ++i) {
+        if (sizes.values[i] < sizeof(uint64_t)) {
+            sizes.values[i] = sizeof(uint64_t);
+        }
+    }
+
+    printf("clients,size,keepalive,pps,mbit,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us,"
+        "setup_avg_us,setup_max_us,setup_failed,cpu_outside_ns,cpu_inside_ns,lost\n");
+    for (unsigned k = 0; k < keepalives.count; ++k) {
+        for (unsigned c = 0; c < clients.count; ++c) {
+            for (unsigned s = 0; s < sizes.count; ++s) {
+                run(clients.values[c], sizes.values[s], keepalives.values[k]);
+            }
+        }
+    }
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include "connlist.h"
 
+#include <pthread.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,55 +10,377 @@
 
 #include "misc.h"
 
-conn_entry_t* conn_table = NULL;
+#define INDEX_INITIAL_SIZE 64
+#define SLAB_BITS 8
+#define SLAB_ENTRIES (1 << SLAB_BITS)
+
+/**
+ * the parts of an entry that are not needed for forwarding and lookups.
+ * They live next to the entries in the same slab but in their own array,
+ * so they don't take up room in the cache lines of the entries.
+ */
+typedef struct {
+    wheel_timer_t timer_expiry;     // removes the entry after it has been inactive for too long
+    wheel_timer_t timer_keepalive;  // free for use by the agent, cancelled on removal
+    uint32_t idx;                   // index of the entry this belongs to
+    uint32_t spare_prev;            // neighbours in the list of spare entries
+    uint32_t spare_next;            // also links the free entries
+    uint32_t hnext_flow;            // next entry in the same flow ID hash bucket
+    conn_extra_t extra;
+} conn_cold_t;
+
+/**
+ * entries are allocated in slabs of 256 and never move, so pointers to
+ * them stay valid until they are removed. Inside the table they refer to
+ * each other by index, the upper bits select the slab.
+ */
+typedef struct {
+    conn_entry_t hot[SLAB_ENTRIES];
+    conn_cold_t cold[SLAB_ENTRIES];
+} conn_slab_t;
+
+#define HOT(i) (&slabs[(i) >> SLAB_BITS]->hot[(i) & (SLAB_ENTRIES - 1)])
+#define COLD(i) (&slabs[(i) >> SLAB_BITS]->cold[(i) & (SLAB_ENTRIES - 1)])
+
+// the same for an entry at hand, without going through the slab array that
+// another thread may be growing, the hot array is at the start of the slab
+#define COLD_OF(e) (&((conn_slab_t*)((e) - ((e)->idx & (SLAB_ENTRIES - 1))))->cold[(e)->idx & (SLAB_ENTRIES - 1)])
+
+_Static_assert(sizeof(conn_entry_t) == 64, "a connection entry must fit in one cache line");
+
+/**
+ * hash index over one of the key fields of the entries. Entries
+ * are chained into the buckets through an intrusive link inside the
+ * entry itself, so indexing an entry never allocates. The number of
+ * buckets is always a power of 2 and doubles when the load factor
+ * exceeds 1. Key and link are either both in conn_entry_t or, for
+ * indexes only used in multiplexed mode, both in conn_cold_t.
+ */
+typedef struct {
+    uint32_t* buckets;
+    unsigned size;
+    unsigned count;
+    bool cold;          // key and link are in conn_cold_t instead of conn_entry_t
+    size_t key_offs;    // offset of the indexed key
+    size_t key_len;     // size of the key, compared bytewise
+    size_t link_offs;   // offset of the bucket chain link
+    uint8_t flag;       // bit in conn_entry_t.indexed telling the entry is in this index
+} conn_index_t;
+
+#define INDEX_BASE(idx, i) ((idx)->cold ? (char*)COLD(i) : (char*)HOT(i))
+#define INDEX_KEY(idx, i) ((void*)(INDEX_BASE(idx, i) + (idx)->key_offs))
+#define INDEX_LINK(idx, i) ((uint32_t*)(INDEX_BASE(idx, i) + (idx)->link_offs))
+
+static conn_slab_t** slabs = NULL;
+static unsigned slab_count = 0;
+static uint32_t free_list = CONN_NONE;
+static bool fixed_capacity = false;
 
 static unsigned count = 0;
+static unsigned spare_count = 0;
+static uint32_t spares = CONN_NONE;
+static __thread int epoll_fd = -1;
+static __thread timer_wheel_t* wheel = NULL;
+static uint64_t lifetime_ms = 60000;
+static bool lifetime_spares = false;
+static void (*remove_callback)(conn_entry_t* entry) = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static conn_index_t index_client = {
+    .key_offs = offsetof(conn_entry_t, addr_client),
+    .key_len = sizeof(struct sockaddr_in),
+    .link_offs = offsetof(conn_entry_t, hnext_client),
+    .flag = 1
+};
+
+static conn_index_t index_tunnel = {
+    .key_offs = offsetof(conn_entry_t, addr_tunnel),
+    .key_len = sizeof(struct sockaddr_in),
+    .link_offs = offsetof(conn_entry_t, hnext_tunnel),
+    .flag = 2
+};
+
+static conn_index_t index_flow = {
+    .cold = true,
+    .key_offs = offsetof(conn_cold_t, extra.flow),
+    .key_len = sizeof(uint32_t),
+    .link_offs = offsetof(conn_cold_t, hnext_flow),
+    .flag = 4
+};
+
+/**
+ * hash the first 8 bytes of the key. For a sockaddr_in these are the
+ * family, the port and the address, the rest is padding. The bucket is
+ * taken from the top bits of the product, only they depend on all bits
+ * of the key, the last byte of the address ends up in the top byte.
+ */
+static unsigned index_hash(conn_index_t* idx, const void* key) {
+    uint64_t k = 0;
+    memcpy(&k, key, idx->key_len < sizeof(k) ? idx->key_len : sizeof(k));
+    k *= 0x9e3779b97f4a7c15ULL;
+    return (unsigned)(k >> (64 - __builtin_ctz(idx->size)));
+}
+
+static void index_resize(conn_index_t* idx, unsigned size) {
+    uint32_t* old = idx->buckets;
+    unsigned old_size = idx->size;
+    idx->buckets = malloc(size * sizeof(uint32_t));
+    memset(idx->buckets, 0xff, size * sizeof(uint32_t));
+    idx->size = size;
+    for (unsigned b = 0; b < old_size; ++b) {
+        uint32_t i = old[b];
+        while (i != CONN_NONE) {
+            uint32_t next = *INDEX_LINK(idx, i);
+            unsigned nb = index_hash(idx, INDEX_KEY(idx, i));
+            *INDEX_LINK(idx, i) = idx->buckets[nb];
+            idx->buckets[nb] = i;
+            i = next;
+        }
+    }
+    free(old);
+}
+
+static void index_add(conn_index_t* idx, conn_entry_t* e) {
+    if (idx->count >= idx->size) {
+        index_resize(idx, idx->size ? idx->size * 2 : INDEX_INITIAL_SIZE);
+    }
+    unsigned b = index_hash(idx, INDEX_KEY(idx, e->idx));
+    *INDEX_LINK(idx, e->idx) = idx->buckets[b];
+    idx->buckets[b] = e->idx;
+    e->indexed |= idx->flag;
+    ++idx->count;
+}
+
+static void index_del(conn_index_t* idx, conn_entry_t* e) {
+    if (!(e->indexed & idx->flag)) {
+        return; // key was never set, entry is not indexed
+    }
+    uint32_t* pp = &idx->buckets[index_hash(idx, INDEX_KEY(idx, e->idx))];
+    while (*pp != CONN_NONE) {
+        if (*pp == e->idx) {
+            *pp = *INDEX_LINK(idx, e->idx);
+            *INDEX_LINK(idx, e->idx) = CONN_NONE;
+            e->indexed &= ~idx->flag;
+            --idx->count;
+            return;
+        }
+        pp = INDEX_LINK(idx, *pp);
+    }
+}
+
+static conn_entry_t* index_find(conn_index_t* idx, const void* key) {
+    if (idx->count == 0) {
+        return NULL;
+    }
+    uint32_t i = idx->buckets[index_hash(idx, key)];
+    while (i != CONN_NONE) {
+        if (memcmp(INDEX_KEY(idx, i), key, idx->key_len) == 0) {
+            return HOT(i);
+        }
+        i = *INDEX_LINK(idx, i);
+    }
+    return NULL;
+}
+
+static void index_set(conn_index_t* idx, conn_entry_t* e, const void* key) {
+    index_del(idx, e);
+    memcpy(INDEX_KEY(idx, e->idx), key, idx->key_len);
+    index_add(idx, e);
+}
+
+/**
+ * allocate one more slab and put the first n of its entries on the free
+ * list, in ascending order so that low indexes are used first.
+ */
+static void slab_grow(unsigned n) {
+    void* mem;
+    if (posix_memalign(&mem, 64, sizeof(conn_slab_t)) != 0) {
+        print(LOG_ERROR, "could not allocate memory for %u connections", SLAB_ENTRIES);
+        exit(EXIT_FAILURE);
+    }
+    slabs = realloc(slabs, (slab_count + 1) * sizeof(conn_slab_t*));
+    slabs[slab_count] = mem;
+    memset(mem, 0, sizeof(conn_slab_t));
+    uint32_t base = slab_count << SLAB_BITS;
+    ++slab_count;
+    for (unsigned k = n; k-- > 0; ) {
+        COLD(base + k)->spare_next = free_list;
+        free_list = base + k;
+    }
+}
 
 /**
- * insert an entry to the connection table. It will allocate new memory
- * on the heap, insert it into the linked list and return a pointer
- * to the newly created entry.
+ * acquire exclusive access to the connection table. All functions of this
+ * module expect the caller to hold the lock when the table is shared
+ * between several threads. Single threaded code may ignore it.
+ */
+void conn_lock(void) {
+    pthread_mutex_lock(&lock);
+}
+
+/**
+ * release the lock acquired with conn_lock()
+ */
+void conn_unlock(void) {
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * expiry timer callback, called with the lock held
+ */
+static void expire(wheel_timer_t* t) {
+    conn_entry_t* e = HOT(container_of(t, conn_cold_t, timer_expiry)->idx);
+    uint64_t now = clock_now();
+    if (e->spare && !lifetime_spares) {
+        wheel_add(t->wheel, t, now + lifetime_ms + 1);
+    } else if (now - e->last_acticity <= lifetime_ms) {
+        wheel_add(t->wheel, t, e->last_acticity + lifetime_ms + 1);
+    } else {
+        print(LOG_DEBUG, "removing connection");
+        conn_table_remove(e);
+        conn_print_numbers();
+    }
+}
+
+/**
+ * insert an entry to the connection table. It takes the next entry from
+ * the free list, allocating another slab if the list is empty, and
+ * returns a pointer to it. With a fixed capacity it returns NULL when
+ * the table is full.
  *
- * @return pointer to the entry in the list on the heap
+ * @return pointer to the new entry or NULL
  */
 conn_entry_t* conn_table_insert(void) {
-    conn_entry_t* e = malloc(sizeof(conn_entry_t));
-    memset(e, 0, sizeof(conn_entry_t));
-    e->next = conn_table;
-    if (e->next != NULL) {
-        e->next->prev = e;
+    if (free_list == CONN_NONE) {
+        if (fixed_capacity) {
+            return NULL;
+        }
+        slab_grow(SLAB_ENTRIES);
     }
-    e->prev = NULL;
-    conn_table = e;
+    uint32_t i = free_list;
+    conn_entry_t* e = HOT(i);
+    conn_cold_t* c = COLD(i);
+    free_list = c->spare_next;
+    memset(e, 0, sizeof(conn_entry_t));
+    memset(c, 0, sizeof(conn_cold_t));
+    e->idx = i;
+    e->used = true;
+    c->idx = i;
+    c->spare_prev = CONN_NONE;
+    c->spare_next = CONN_NONE;
+    c->extra.mux = CONN_NONE;
+    e->last_acticity = clock_now();
+    wheel_timer_init(&c->timer_expiry, expire);
+    wheel_add(wheel, &c->timer_expiry, e->last_acticity + lifetime_ms + 1);
     ++count;
     return e;
 }
 
 /**
  * remove an entry from the connection table.
- * The entry will also be freed from the heap.
+ * The entry goes back to the free list.
  *
  * @param entry pointer to the entry to be removed
  */
 void conn_table_remove(conn_entry_t* entry) {
-    if (entry->prev != NULL) {
-        entry->prev->next = entry->next;
-    } else {
-        conn_table = entry->next;
-    }
-    if (entry->next != NULL) {
-        entry->next->prev = entry->prev;
+    conn_cold_t* c = COLD(entry->idx);
+    if (remove_callback) {
+        remove_callback(entry);
     }
+    conn_set_spare(entry, false);
+    wheel_del(&c->timer_expiry);
+    wheel_del(&c->timer_keepalive);
+    index_del(&index_client, entry);
+    index_del(&index_tunnel, entry);
+    index_del(&index_flow, entry);
     if (entry->sock_service > 0) {
+        if (epoll_fd >= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, entry->sock_service, NULL);
+        }
         close(entry->sock_service);
     }
     if (entry->sock_tunnel > 0) {
+        if (epoll_fd >= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, entry->sock_tunnel, NULL);
+        }
         close(entry->sock_tunnel);
     }
-    free(entry);
+    entry->used = false;
+    c->spare_next = free_list;
+    free_list = entry->idx;
     --count;
 }
 
+/**
+ * set the client address of an entry and (re)index it, so that it can
+ * be found by conn_table_find_client_address().
+ *
+ * @param entry pointer to the entry
+ * @param addr pointer to sockaddr struct
+ */
+void conn_set_client_address(conn_entry_t* entry, struct sockaddr_in* addr) {
+    index_set(&index_client, entry, addr);
+}
+
+/**
+ * set the tunnel address of an entry and (re)index it, so that it can
+ * be found by conn_table_find_tunnel_address().
+ *
+ * @param entry pointer to the entry
+ * @param addr pointer to sockaddr struct
+ */
+void conn_set_tunnel_address(conn_entry_t* entry, struct sockaddr_in* addr) {
+    index_set(&index_tunnel, entry, addr);
+}
+
+/**
+ * set the flow ID of an entry and (re)index it, so that it can be found
+ * by conn_table_find_flow(). Only used in multiplexed mode.
+ *
+ * @param entry pointer to the entry
+ * @param flow flow ID in host byte order
+ */
+void conn_set_flow(conn_entry_t* entry, uint32_t flow) {
+    index_set(&index_flow, entry, &flow);
+}
+
+/**
+ * set or clear the spare flag of an entry. Spare entries are additionally
+ * kept in their own list, so that the next spare can be found without
+ * walking the entire connection table.
+ *
+ * @param entry pointer to the entry
+ * @param spare new value of the spare flag
+ */
+void conn_set_spare(conn_entry_t* entry, bool spare) {
+    if (spare == entry->spare) {
+        return;
+    }
+    conn_cold_t* c = COLD(entry->idx);
+    entry->spare = spare;
+    if (spare) {
+        c->spare_prev = CONN_NONE;
+        c->spare_next = spares;
+        if (spares != CONN_NONE) {
+            COLD(spares)->spare_prev = entry->idx;
+        }
+        spares = entry->idx;
+        ++spare_count;
+    } else {
+        if (c->spare_prev != CONN_NONE) {
+            COLD(c->spare_prev)->spare_next = c->spare_next;
+        } else {
+            spares = c->spare_next;
+        }
+        if (c->spare_next != CONN_NONE) {
+            COLD(c->spare_next)->spare_prev = c->spare_prev;
+        }
+        c->spare_prev = CONN_NONE;
+        c->spare_next = CONN_NONE;
+        --spare_count;
+    }
+}
+
 /**
  * find the connection table entry by its client address. It will compare
  * the entire sockaddr struct (port and address) to identify the
@@ -67,14 +390,7 @@ void conn_table_remove(conn_entry_t* entry) {
  * @return pointer to connection table entry or NULL
  */
 conn_entry_t* conn_table_find_client_address(struct sockaddr_in* addr) {
-    conn_entry_t* p = conn_table;
-    while (p != NULL) {
-        if (memcmp(&p->addr_client, addr, sizeof(struct sockaddr_in)) == 0) {
-            return p;
-        }
-        p = p->next;
-    }
-    return NULL;
+    return index_find(&index_client, addr);
 }
 
 /**
@@ -86,14 +402,18 @@ conn_entry_t* conn_table_find_client_address(struct sockaddr_in* addr) {
  * @return pointer to connection table entry or NULL
  */
 conn_entry_t* conn_table_find_tunnel_address(struct sockaddr_in* addr) {
-    conn_entry_t* p = conn_table;
-    while (p != NULL) {
-        if (memcmp(&p->addr_tunnel, addr, sizeof(struct sockaddr_in)) == 0) {
-            return p;
-        }
-        p = p->next;
-    }
-    return NULL;
+    return index_find(&index_tunnel, addr);
+}
+
+/**
+ * find the connection table entry by its flow ID. If not found it will
+ * return NULL.
+ *
+ * @param flow flow ID in host byte order
+ * @return pointer to connection table entry or NULL
+ */
+conn_entry_t* conn_table_find_flow(uint32_t flow) {
+    return index_find(&index_flow, &flow);
 }
 
 /**
@@ -101,40 +421,170 @@ conn_entry_t* conn_table_find_tunnel_address(struct sockaddr_in* addr) {
  * return NULL if no such entry exists.
  */
 conn_entry_t* conn_table_find_next_spare(void) {
-    conn_entry_t* p = conn_table;
-    while (p != NULL) {
-        if (p->spare) {
-            return p;
-        }
-        p = p->next;
+    return (spares != CONN_NONE) ? HOT(spares) : NULL;
+}
+
+/**
+ * return the n-th entry in the list of spares, n must be smaller than
+ * conn_spare_count(). In multiplexed mode the spares are the shared
+ * tunnels and the list is short, so walking it is cheap.
+ */
+conn_entry_t* conn_table_find_spare(unsigned n) {
+    uint32_t i = spares;
+    while ((i != CONN_NONE) && n--) {
+        i = COLD(i)->spare_next;
     }
-    return NULL;
+    return (i != CONN_NONE) ? HOT(i) : NULL;
+}
+
+/**
+ * return the entry with the given slab index, for following the index
+ * links kept in conn_extra_t
+ */
+conn_entry_t* conn_table_get(uint32_t idx) {
+    return HOT(idx);
 }
 
 /**
- * check all connection table entries for their last usage time and remove
- * all entries that have been inactive for longer than the defined lifetime.
- * This function is meant to be called periodically every few seconds.
+ * declare the epoll instance the calling thread registers its sockets with
+ * and the timer wheel that drives the expiry of the entries it inserts.
+ * conn_table_remove() will also unregister the sockets of the removed
+ * entry from the epoll instance.
  *
- * @param max_age inactivity time in seconds
- * @param clean_spares should spare entries also be cleaned
- */
-void conn_table_clean(unsigned max_age, bool clean_spares) {
-    conn_entry_t* e = conn_table;
-    bool changed = false;
-    uint64_t time = millisec();
-    while (e != NULL) {
-        conn_entry_t* next = e->next;
-        if ((time - e->last_acticity > max_age * 1000) && (clean_spares || !e->spare)) {
-            print(LOG_DEBUG, "removing connection");
-            conn_table_remove(e);
-            changed = true;
+ * @param epfd epoll file descriptor or -1
+ * @param w timer wheel of the calling thread
+ */
+void conn_table_set_worker(int epfd, timer_wheel_t* w) {
+    epoll_fd = epfd;
+    wheel = w;
+}
+
+/**
+ * move the timers of an entry to the wheel of the calling thread, from
+ * then on that thread expires the entry and conn_table_remove() is called
+ * by it. For handing entries over between threads that share the table.
+ *
+ * @param entry pointer to the entry
+ */
+void conn_table_adopt(conn_entry_t* entry) {
+    conn_cold_t* c = COLD(entry->idx);
+    if (c->timer_expiry.pprev) {
+        wheel_add(wheel, &c->timer_expiry, c->timer_expiry.expires);
+    }
+    if (c->timer_keepalive.pprev) {
+        wheel_add(wheel, &c->timer_keepalive, c->timer_keepalive.expires);
+    }
+}
+
+/**
+ * call a function for every entry owned by the calling thread, that is
+ * every entry whose timers are driven by its wheel. The function may
+ * remove the entry. Must be called with the lock held.
+ *
+ * @param fn function to call
+ * @param arg passed on to the function
+ */
+void conn_table_foreach_owned(void (*fn)(conn_entry_t* entry, void* arg), void* arg) {
+    for (uint32_t i = 0; i < (slab_count << SLAB_BITS); ++i) {
+        if (HOT(i)->used && (COLD(i)->timer_expiry.wheel == wheel)) {
+            fn(HOT(i), arg);
         }
-        e = next;
     }
-    if (changed) {
-        conn_print_numbers();
+}
+
+/**
+ * allocate room for a fixed number of entries up front, after this the
+ * table never allocates again and conn_table_insert() fails when it is
+ * full. Must be called before the first entry is inserted.
+ *
+ * @param max number of entries
+ */
+void conn_table_set_capacity(unsigned max) {
+    for (unsigned n = 0; n < max; n += SLAB_ENTRIES) {
+        slab_grow((max - n < SLAB_ENTRIES) ? max - n : SLAB_ENTRIES);
     }
+    fixed_capacity = true;
+    print(LOG_INFO, "connection table fixed at %u entries, %zu KiB", max, slab_count * sizeof(conn_slab_t) / 1024);
+}
+
+/**
+ * set a function that conn_table_remove() calls for every entry before
+ * it is released, for cleanup the agent does outside of the table
+ *
+ * @param callback function to call with the lock held, or NULL
+ */
+void conn_table_set_remove_callback(void (*callback)(conn_entry_t* entry)) {
+    remove_callback = callback;
+}
+
+/**
+ * the fields of an entry that are not needed for every datagram. Like the
+ * entry itself this may be used without the lock by the thread owning the
+ * entry, the pointer stays valid as long as the entry is in the table.
+ */
+conn_extra_t* conn_extra(conn_entry_t* entry) {
+    return &COLD_OF(entry)->extra;
+}
+
+/**
+ * the timer of an entry that is reserved for the agent's keepalives
+ */
+wheel_timer_t* conn_keepalive_timer(conn_entry_t* entry) {
+    return &COLD_OF(entry)->timer_keepalive;
+}
+
+/**
+ * get back from a timer returned by conn_keepalive_timer() to its entry
+ */
+conn_entry_t* conn_from_keepalive_timer(wheel_timer_t* timer) {
+    return HOT(container_of(timer, conn_cold_t, timer_keepalive)->idx);
+}
+
+/**
+ * set after how much inactivity entries are removed. Every entry has an
+ * expiry timer that fires when this time has passed since the entry
+ * became active, instead of rescheduling the timer on every datagram
+ * the timer simply checks the last activity when it fires and goes
+ * back to sleep if there was any.
+ *
+ * @param max_age inactivity time in seconds
+ * @param clean_spares should spare entries also be removed
+ */
+void conn_table_set_lifetime(unsigned max_age, bool clean_spares) {
+    lifetime_ms = max_age * 1000ULL;
+    lifetime_spares = clean_spares;
+}
+
+/**
+ * register one of the sockets of an entry with the epoll instance. The
+ * entry pointer is stored in the event data, tagged in its lowest bit
+ * with the kind of socket, so the event loop can dispatch directly
+ * without looking anything up.
+ *
+ * @param entry pointer to the entry owning the socket
+ * @param kind which of the two sockets of the entry to register
+ */
+void conn_watch_socket(conn_entry_t* entry, conn_sock_kind_t kind) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uintptr_t)entry | kind;
+    int sock = (kind == CONN_SOCK_TUNNEL) ? entry->sock_tunnel : entry->sock_service;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        print_e(LOG_ERROR, "could not add socket to epoll set");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * decode the event data set by conn_watch_socket()
+ *
+ * @param event pointer to the event returned by epoll_wait()
+ * @param kind will receive the kind of socket that became ready
+ * @return pointer to the entry owning the socket
+ */
+conn_entry_t* conn_from_event(struct epoll_event* event, conn_sock_kind_t* kind) {
+    *kind = event->data.u64 & 1;
+    return (conn_entry_t*)(uintptr_t)(event->data.u64 & ~(uint64_t)1);
 }
 
 unsigned conn_count() {
@@ -142,28 +592,39 @@ unsigned conn_count() {
 }
 
 unsigned conn_spare_count() {
-    conn_entry_t* e = conn_table;
+    return spare_count;
+}
+
+unsigned conn_socket_count() {
     unsigned cnt = 0;
-    while (e) {
-        if (e->spare) {
+    for (uint32_t i = 0; i < (slab_count << SLAB_BITS); ++i) {
+        conn_entry_t* e = HOT(i);
+        if (e->used && e->sock_service) {
+            ++cnt;
+        }
+        if (e->used && e->sock_tunnel) {
             ++cnt;
         }
-        e = e->next;
     }
     return cnt;
 }
 
-unsigned conn_socket_count() {
-    conn_entry_t* e = conn_table;
+/**
+ * copy the entries in use, for reporting them without holding the lock
+ * for longer than necessary.
+ *
+ * @param out array receiving the copies
+ * @param out_extra array receiving the copies of their conn_extra_t
+ * @param max size of the arrays
+ * @return number of entries copied
+ */
+unsigned conn_table_snapshot(conn_entry_t* out, conn_extra_t* out_extra, unsigned max) {
     unsigned cnt = 0;
-    while (e) {
-        if (e->sock_service) {
-            ++cnt;
-        }
-        if (e->sock_tunnel) {
-            ++cnt;
+    for (uint32_t i = 0; (i < (slab_count << SLAB_BITS)) && (cnt < max); ++i) {
+        if (HOT(i)->used) {
+            out_extra[cnt] = COLD(i)->extra;
+            out[cnt++] = *HOT(i);
         }
-        e = e->next;
     }
     return cnt;
 }
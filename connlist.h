@@ -1,36 +1,86 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+
+#include "wheel.h"
 
 #ifndef CONNLIST_H
 #define CONNLIST_H
 
+#define CONN_NONE UINT32_MAX
+
+/**
+ * a connection table entry with the fields needed for forwarding and
+ * lookups, the links to other entries are slab indexes. It takes exactly
+ * one cache line, the timers, counters and other rarely used fields are
+ * kept by the table elsewhere.
+ */
 typedef struct conn_entry conn_entry_t;
 struct conn_entry {
     struct sockaddr_in addr_client;
     struct sockaddr_in addr_tunnel;
-    int sock_service;
-    int sock_service_pollidx;
+    uint64_t last_acticity;
+    int sock_service;               // outside: socket connected to the client, if any
     int sock_tunnel;
-    int sock_tunnel_pollidx;
-    conn_entry_t* prev;
-    conn_entry_t* next;
+    uint32_t idx;                   // index of this entry in the slabs
+    uint32_t hnext_client;          // next entry in the same client address hash bucket
+    uint32_t hnext_tunnel;          // next entry in the same tunnel address hash bucket
+    uint8_t indexed;                // bitmask of the hash indexes this entry is linked into
     bool spare;
-    uint64_t last_keepalive;
-    uint64_t last_acticity;
+    bool used;
 };
 
-extern conn_entry_t* conn_table;
+/**
+ * the fields of an entry that are not needed for every datagram, or only
+ * in multiplexed mode. The table keeps them next to the timers, see
+ * conn_extra().
+ */
+typedef struct {
+    uint64_t packets_up;            // forwarded towards the service
+    uint64_t bytes_up;
+    uint64_t packets_down;          // forwarded towards the client
+    uint64_t bytes_down;
+    uint64_t xdp_packets[2];        // outside: counters of the XDP program at the last sync, per direction
+    uint64_t xdp_bytes[2];
+    uint32_t flow;                  // multiplexed mode: flow ID of this client
+    uint32_t mux;                   // multiplexed mode: index of the tunnel entry carrying this flow, or CONN_NONE
+} conn_extra_t;
+
+typedef enum {
+    CONN_SOCK_SERVICE = 0,
+    CONN_SOCK_TUNNEL = 1
+} conn_sock_kind_t;
 
+void conn_lock(void);
+void conn_unlock(void);
 conn_entry_t* conn_table_insert(void);
 void conn_table_remove(conn_entry_t* entry);
+void conn_set_client_address(conn_entry_t* entry, struct sockaddr_in* addr);
+void conn_set_tunnel_address(conn_entry_t* entry, struct sockaddr_in* addr);
+void conn_set_flow(conn_entry_t* entry, uint32_t flow);
+void conn_set_spare(conn_entry_t* entry, bool spare);
 conn_entry_t* conn_table_find_client_address(struct sockaddr_in* addr);
 conn_entry_t* conn_table_find_tunnel_address(struct sockaddr_in* addr);
+conn_entry_t* conn_table_find_flow(uint32_t flow);
 conn_entry_t* conn_table_find_next_spare(void);
-void conn_table_clean(unsigned max_age, bool clean_spares);
+conn_entry_t* conn_table_find_spare(unsigned n);
+conn_entry_t* conn_table_get(uint32_t idx);
+void conn_table_set_worker(int epfd, timer_wheel_t* wheel);
+void conn_table_set_lifetime(unsigned max_age, bool clean_spares);
+void conn_table_set_capacity(unsigned max);
+void conn_table_set_remove_callback(void (*callback)(conn_entry_t* entry));
+void conn_table_adopt(conn_entry_t* entry);
+void conn_table_foreach_owned(void (*fn)(conn_entry_t* entry, void* arg), void* arg);
+conn_extra_t* conn_extra(conn_entry_t* entry);
+wheel_timer_t* conn_keepalive_timer(conn_entry_t* entry);
+conn_entry_t* conn_from_keepalive_timer(wheel_timer_t* timer);
+void conn_watch_socket(conn_entry_t* entry, conn_sock_kind_t kind);
+conn_entry_t* conn_from_event(struct epoll_event* event, conn_sock_kind_t* kind);
 unsigned conn_count();
 unsigned conn_spare_count();
 unsigned conn_socket_count();
+unsigned conn_table_snapshot(conn_entry_t* out, conn_extra_t* out_extra, unsigned max);
 void conn_print_numbers();
 
 #endif // CONNLIST_H
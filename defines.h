@@ -3,6 +3,24 @@
 
 #define CONN_LIFETIME_SECONDS   60
 #define BUF_SIZE                0xffff
+#define MUX_HDR_SIZE            4       // flow ID in front of every datagram in multiplexed mode
+#define PENDING_SLOT_SIZE       2048    // largest datagram held while a new client waits for a tunnel
+#define PENDING_PER_CLIENT      8       // datagrams held per waiting client
+#define PENDING_MAX_CLIENTS     64      // clients waiting for a tunnel at the same time
+#define PENDING_MAX_AGE_MS      3000    // held datagrams older than this are dropped
+#define PENDING_OUTBOX          (4 * PENDING_PER_CLIENT) // held datagrams a worker has room for at first, the outbox grows as needed
+#define PREAUTH_BUCKETS         4096    // token buckets for the source addresses of keepalive sized datagrams, power of 2
+#define PREAUTH_RATE            100     // keepalive sized datagrams per second and source address that get hashed
+#define PREAUTH_BURST           1000    // ... and how many of them at once, the inside agent starts all spares at once
+#define NONCE_MAX_AHEAD_MS      86400000 // how far a keepalive nonce may be ahead of our own clock
+#define EPOLL_MAX_EVENTS        64
+#define URING_BUFS              256     // provided receive buffers per io_uring, power of 2
+#define URING_BUF_SIZE          (BUF_SIZE + 64) // room for io_uring_recvmsg_out and source address
+#define URING_SQPOLL_IDLE_MS    100     // the kernel thread of --sqpoll goes to sleep after this long without work
+#define XDP_MAX_FLOWS           65536   // clients forwarded by the XDP program without --max-conns
+#define XDP_SYNC_MS             1000    // how often the counters of the XDP program are collected
+#define RESOLVE_MIN_SECONDS     5       // shortest interval between two lookups of the outside host, whatever the TTL
+#define RESOLVE_RETRY_SECONDS   30      // ... and after a failed lookup
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
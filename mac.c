@@ -4,50 +4,178 @@
 #include <string.h>
 #include "sha-256.h"
 
-static uint64_t last_nonce = 0;
-static size_t secret_len = 0;
-static char* secret = NULL;
+#define MAC_BATCH 16
+#define REPLAY_WINDOW 4096      // how far a nonce may lag behind the newest accepted one
+#define REPLAY_SLOTS 256        // 32 nonces each, must cover REPLAY_WINDOW plus one slot
+
+/**
+ * The authentication code is an HMAC-SHA256 over the message and the
+ * nonce. The key is fixed for the lifetime of the process, so the hash
+ * states after the inner and the outer key block are computed once in
+ * mac_init() and every code starts from copies of them. Generating or
+ * verifying a code then only costs the blocks of the message itself and
+ * never allocates.
+ */
+static struct Sha_256 inner;
+static struct Sha_256 outer;
+static uint8_t unused_hash[SIZE_OF_SHA_256_HASH];
+
+/**
+ * Replay protection is a sliding window over the nonces, like the anti
+ * replay window of IPsec or WireGuard. A nonce is accepted once if it is
+ * not older than REPLAY_WINDOW below the newest accepted nonce, so
+ * keepalives of different tunnels may arrive in any order. The window is
+ * a ring of slots, each holds a 32 bit bitmap for a block of 32 nonces,
+ * tagged in its upper half with the round of the ring the block belongs
+ * to (block / REPLAY_SLOTS, truncated to 32 bits, which only wraps after
+ * centuries of millisecond nonces). A slot that is all zero has never
+ * been used. A slot is recycled when a nonce of a newer round maps to it.
+ * Slots and the newest nonce are updated with compare and swap, so any
+ * number of threads can verify concurrently without a lock.
+ *
+ * There is one window per key. The source address can not be used to
+ * tell peers apart, replaying a keepalive from another address is
+ * exactly what an attacker would do.
+ */
+static uint64_t replay_top = 0;
+static uint64_t replay_slots[REPLAY_SLOTS];
 
 void mac_init(const char* sec, size_t seclen) {
+    uint8_t key[SIZE_OF_SHA_256_CHUNK] = {0};
+    uint8_t pad[SIZE_OF_SHA_256_CHUNK];
+
     if ((sec == NULL) || (seclen == 0)) {
-        sec = NULL;
         seclen = 0;
+    } else if (seclen > sizeof(key)) {
+        calc_sha_256(key, sec, seclen);
+    } else {
+        memcpy(key, sec, seclen);
     }
-    if (secret_len) {
-        free(secret);
+
+    for (size_t i = 0; i < sizeof(key); ++i) {
+        pad[i] = key[i] ^ 0x36;
     }
-    secret_len = seclen;
-    if (seclen) {
-        secret = malloc(seclen);
-        memcpy(secret, sec, seclen);
-    } else {
-        secret = NULL;
+    sha_256_init(&inner, unused_hash);
+    sha_256_write(&inner, pad, sizeof(pad));
+    for (size_t i = 0; i < sizeof(key); ++i) {
+        pad[i] = key[i] ^ 0x5c;
     }
-    last_nonce = 0;
+    sha_256_init(&outer, unused_hash);
+    sha_256_write(&outer, pad, sizeof(pad));
+
+    memset(key, 0, sizeof(key));
+    memset(pad, 0, sizeof(pad));
+    replay_top = 0;
+    memset(replay_slots, 0, sizeof(replay_slots));
 }
 
 mac_t mac_gen(const char* msg, size_t msglen, uint64_t nonce) {
     mac_t mac;
-    if ((msg == NULL) || (msglen == 0)) {
-        msg = NULL;
-        msglen = 0;
-    }
-    char* buf = malloc(secret_len + msglen + sizeof(nonce));
-    memcpy(buf, secret, secret_len);
-    memcpy(buf + secret_len, msg, msglen);
-    memcpy(buf + secret_len + msglen, &nonce, sizeof(nonce));
-    calc_sha_256(mac.hash, buf, secret_len + msglen + sizeof(nonce));
+    struct Sha_256 sha;
+    uint8_t inner_hash[SIZE_OF_SHA_256_HASH];
+
+    sha_256_copy(&sha, &inner, inner_hash);
+    if ((msg != NULL) && (msglen > 0)) {
+        sha_256_write(&sha, msg, msglen);
+    }
+    sha_256_write(&sha, &nonce, sizeof(nonce));
+    sha_256_close(&sha);
+
+    sha_256_copy(&sha, &outer, mac.hash);
+    sha_256_write(&sha, inner_hash, sizeof(inner_hash));
+    sha_256_close(&sha);
     mac.nonce = nonce;
-    free(buf);
     return mac;
 }
 
+/**
+ * verify the authentication codes of several keepalives (codes for an
+ * empty message) at once, using the multi-buffer SHA-256. This only checks
+ * the codes themselves, the nonces must still be passed to mac_accept().
+ *
+ * @param macs the received codes
+ * @param count number of codes
+ * @param valid will receive the result for each code
+ */
+void mac_check_keepalives(const mac_t* macs, unsigned count, bool* valid) {
+    uint8_t inner_hash[MAC_BATCH][SIZE_OF_SHA_256_HASH];
+    uint8_t outer_hash[MAC_BATCH][SIZE_OF_SHA_256_HASH];
+    const void* input[MAC_BATCH];
+
+    for (unsigned n = 0; n < count; n += MAC_BATCH) {
+        unsigned k = (count - n < MAC_BATCH) ? count - n : MAC_BATCH;
+        for (unsigned i = 0; i < k; ++i) {
+            input[i] = &macs[n + i].nonce;
+        }
+        sha_256_close_multi(&inner, inner_hash, input, sizeof(uint64_t), k);
+        for (unsigned i = 0; i < k; ++i) {
+            input[i] = inner_hash[i];
+        }
+        sha_256_close_multi(&outer, outer_hash, input, SIZE_OF_SHA_256_HASH, k);
+        for (unsigned i = 0; i < k; ++i) {
+            valid[n + i] = (memcmp(outer_hash[i], macs[n + i].hash, SIZE_OF_SHA_256_HASH) == 0);
+        }
+    }
+}
+
+/**
+ * how many rounds of the ring the block of a nonce is ahead of the block
+ * a slot holds, negative if the slot holds a newer one
+ */
+static int32_t slot_age(uint64_t slot, uint64_t nonce) {
+    return (uint32_t)(nonce / 32 / REPLAY_SLOTS) - (uint32_t)(slot >> 32);
+}
+
+/**
+ * check whether a nonce could still be accepted, without marking it as
+ * used. Meant for rejecting junk before calculating its code.
+ */
+bool mac_nonce_fresh(uint64_t nonce) {
+    uint64_t top = __atomic_load_n(&replay_top, __ATOMIC_RELAXED);
+    if (nonce + REPLAY_WINDOW <= top) {
+        return false;
+    }
+    uint64_t slot = __atomic_load_n(&replay_slots[(nonce >> 5) % REPLAY_SLOTS], __ATOMIC_RELAXED);
+    int32_t age = slot_age(slot, nonce);
+    return (slot == 0) || (age > 0) || ((age == 0) && !(slot & (1U << (nonce & 31))));
+}
+
+/**
+ * accept the nonce of a verified code if it is inside the window and has
+ * not been seen before, each code can only be used once.
+ */
+bool mac_accept(uint64_t nonce) {
+    if (nonce + REPLAY_WINDOW <= __atomic_load_n(&replay_top, __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    // mark the nonce in the bitmap of its block, recycling the slot if it is unused or still belongs to an older block
+    uint32_t round = nonce / 32 / REPLAY_SLOTS;
+    uint32_t bit = 1U << (nonce & 31);
+    uint64_t* slot = &replay_slots[(nonce >> 5) % REPLAY_SLOTS];
+    uint64_t old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    uint64_t new;
+    do {
+        int32_t age = slot_age(old, nonce);
+        if ((old == 0) || (age > 0)) {
+            new = (uint64_t)round << 32 | bit;
+        } else if ((age == 0) && !(old & bit)) {
+            new = old | bit;
+        } else {
+            return false; // already seen, or the slot belongs to a newer block and the nonce is too old
+        }
+    } while (!__atomic_compare_exchange_n(slot, &old, new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    uint64_t top = __atomic_load_n(&replay_top, __ATOMIC_RELAXED);
+    while ((nonce > top) && !__atomic_compare_exchange_n(&replay_top, &top, nonce, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
 bool mac_test(const char* msg, size_t msglen, mac_t mac) {
-    if (mac.nonce > last_nonce) {
+    if (mac_nonce_fresh(mac.nonce)) {
         mac_t own_mac = mac_gen(msg, msglen, mac.nonce);
         if (memcmp(&own_mac, &mac, sizeof(mac_t)) == 0) {
-            last_nonce = mac.nonce;
-            return true;
+            return mac_accept(mac.nonce);
         }
     }
     return false;
@@ -13,5 +13,8 @@ typedef struct {
 void mac_init(const char* sec, size_t seclen);
 mac_t mac_gen(const char* msg, size_t msglen, uint64_t nonce);
 bool mac_test(const char* msg, size_t msglen, mac_t mac);
+void mac_check_keepalives(const mac_t* macs, unsigned count, bool* valid);
+bool mac_accept(uint64_t nonce);
+bool mac_nonce_fresh(uint64_t nonce);
 
 #endif
@@ -1,160 +1,593 @@
+#define _GNU_SOURCE
 #include "main-inside.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
-#include <sys/poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "connlist.h"
 #include "mac.h"
+#include "metrics.h"
 #include "misc.h"
+#include "resolve.h"
 #include "defines.h"
+#include "udp.h"
 
-void run_inside(args_parsed_t args) {
-    ssize_t nbytes;
-    struct sockaddr_in addr_outside = {0};
-    struct sockaddr_in addr_service = {0};
-    struct sockaddr_in addr_incoming = {0};
-    struct hostent* he;
-    socklen_t len_addr = sizeof(struct sockaddr_in);
-    struct pollfd* pfds = NULL;
-    char buffer[BUF_SIZE];
+/**
+ * Datagrams are received and sent in batches, each worker has a ring of
+ * slots for them. A slot must be able to hold anything the other agent
+ * may send, so it has room for a full datagram (or train) plus a flow ID
+ * header in front, but only the pages actually written ever become
+ * resident, with the usual datagram sizes that is one page per slot.
+ */
+typedef struct {
+    unsigned size;
+    char* slots;                // size slots of BUF_SIZE bytes
+    char* ctrls_in;
+    char* ctrls_out;
+    struct iovec* iovs_in;
+    struct iovec* iovs_out;
+    struct mmsghdr* msgs_in;
+    struct mmsghdr* msgs_out;
+} batch_t;
 
+/**
+ * Every client connection is owned by exactly one worker thread. The worker
+ * has its own epoll set with the sockets of all connections it owns, so it
+ * can forward their data without ever touching another worker's state.
+ * The connection table itself is shared and only locked for inserting,
+ * activating and removing connections.
+ */
+typedef struct {
+    pthread_t thread;
+    unsigned id;
+    int epfd;
+    int evfd;   // workers write to this eventfd to request a new spare tunnel
+    int mvfd;   // the resolver writes to this eventfd when the outside host got a new address
+    bool moved;
+    timer_wheel_t wheel;
+    unsigned spares_missing;    // spares that could not be created because the table was full
+    bool table_full;
+    batch_t batch;
+} worker_t;
 
-    print(LOG_INFO, "UDP tunnel inside agent v" VERSION_STR);
-    print(LOG_INFO, "building tunnels to outside agent at %s, port %d", args.outside_host, args.outside_port);
-    print(LOG_INFO, "forwarding incomimg UDP to %s, port %d", args.service_host, args.service_port);
+static args_parsed_t args;
+static struct sockaddr_in addr_outside_resolved = {0};   // only used with the table lock held
+static __thread struct sockaddr_in addr_outside;        // each worker's copy of it
+static struct sockaddr_in addr_service = {0};
+static worker_t* workers = NULL;
+static unsigned next_spare_worker = 0;
+static uint64_t last_nonce = 0;
+
+static void keepalive_due(wheel_timer_t* t);
 
-    if ((he = gethostbyname(args.outside_host)) == NULL) {
-        print_e(LOG_ERROR, "outside host name '%s' could not be resolved", args.outside_host);
+/**
+ * create a new spare tunnel with its own outgoing socket and register
+ * the socket with the epoll set of the calling worker. Its first keepalive
+ * is due immediately, it goes out at the end of the current loop iteration,
+ * so the outside agent can hand out the spare right away. If the connection
+ * table is full the worker remembers it and tries again later.
+ */
+static void create_spare(worker_t* self) {
+    conn_lock();
+    conn_entry_t* spare_conn = conn_table_insert();
+    if (spare_conn == NULL) {
+        conn_unlock();
+        ++self->spares_missing;
+        if (!self->table_full) {
+            print(LOG_WARN, "connection table is full, could not create spare tunnel");
+            self->table_full = true;
+        }
+        return;
+    }
+    self->table_full = false;
+    conn_set_spare(spare_conn, true);
+    wheel_timer_init(conn_keepalive_timer(spare_conn), keepalive_due);
+    wheel_add(&self->wheel, conn_keepalive_timer(spare_conn), clock_now());
+    conn_unlock();
+    spare_conn->sock_tunnel = socket(AF_INET, SOCK_DGRAM, 0);
+    if (spare_conn->sock_tunnel < 0) {
+        print_e(LOG_ERROR, "could not create UDP socket for new spare connection");
         exit(EXIT_FAILURE);
     }
+    if (args.gso) {
+        udp_enable_gro(spare_conn->sock_tunnel);
+    }
+    udp_enable_timestamps(spare_conn->sock_tunnel);
+    conn_watch_socket(spare_conn, CONN_SOCK_TUNNEL);
+}
 
-    memcpy(&addr_outside.sin_addr, he->h_addr_list[0], he->h_length);
-    addr_outside.sin_family = AF_INET;
-    addr_outside.sin_port = htons(args.outside_port);
+/**
+ * make sure a new spare tunnel gets created. Spares are handed out to the
+ * workers round robin, so that the client connections which will later
+ * arrive on them are spread evenly across all workers. The request always
+ * goes through the eventfd of the chosen worker, even if that is the
+ * calling worker itself, so the spare gets created after the current
+ * events have been forwarded and not in the middle of them.
+ */
+static void request_spare(void) {
+    unsigned id = __atomic_fetch_add(&next_spare_worker, 1, __ATOMIC_RELAXED) % args.threads;
+    uint64_t one = 1;
+    if (write(workers[id].evfd, &one, sizeof(one)) < 0) {
+        print_e(LOG_ERROR, "could not request spare tunnel from worker %u", id);
+    }
+}
 
-    if ((he = gethostbyname(args.service_host)) == NULL) {
-        print_e(LOG_ERROR, "srvice host name '%s' could not be resolved", args.service_host);
-        exit(EXIT_FAILURE);
+/**
+ * forward a datagram that came in on one of the shared tunnels in
+ * multiplexed mode to the service socket of its flow, creating the flow
+ * on its first datagram. The flow belongs to the worker that created it
+ * but the outside agent may later send it over a tunnel of another worker,
+ * so unlike in the regular mode the entry is only looked up and touched
+ * with the lock held. The datagram is sent after releasing it.
+ *
+ * @param tunnel the tunnel entry the datagram came in on
+ * @param buffer the datagram, starting with the flow ID
+ * @param nbytes length of the datagram
+ * @param rx arrival time of the datagram
+ */
+static void forward_mux(conn_entry_t* tunnel, const char* buffer, size_t nbytes, uint64_t rx) {
+    uint32_t flow;
+    if (nbytes < MUX_HDR_SIZE) {
+        return;
     }
+    memcpy(&flow, buffer, MUX_HDR_SIZE);
+    flow = ntohl(flow);
 
-    memcpy(&addr_service.sin_addr, he->h_addr_list[0], he->h_length);
-    addr_service.sin_family = AF_INET;
-    addr_service.sin_port = htons(args.service_port);
+    conn_lock();
+    conn_entry_t* e = conn_table_find_flow(flow);
+    if (e == NULL) {
+        print(LOG_INFO, "new client flow %08x, creating socket for it", flow);
+        e = conn_table_insert();
+        if (e == NULL) {
+            conn_unlock();
+            METRIC_INC(drop_table_full);
+            print(LOG_WARN, "connection table is full, dropping datagram of new flow");
+            return;
+        }
+        conn_set_flow(e, flow);
+        conn_extra(e)->mux = tunnel->idx;
+        e->sock_service = socket(AF_INET, SOCK_DGRAM, 0);
+        if (e->sock_service < 0) {
+            print_e(LOG_ERROR, "could not create new UDP socket for service");
+            exit(EXIT_FAILURE);
+        }
+        udp_enable_timestamps(e->sock_service);
+        conn_watch_socket(e, CONN_SOCK_SERVICE);
+        conn_print_numbers();
+    }
+    e->last_acticity = clock_now();
+    int sock = e->sock_service;
+    conn_extra_t* x = conn_extra(e);
+    conn_unlock();
 
-    // we start out with one unused spare tunnel
-    conn_entry_t* spare_conn = conn_table_insert();
-    print(LOG_INFO, "creating initial outgoing tunnel");
-    spare_conn->spare = true;
-    spare_conn->sock_tunnel = socket(AF_INET, SOCK_DGRAM, 0);
-    if (spare_conn->sock_tunnel < 0) {
-        print_e(LOG_ERROR, "could not create new UDP socket for tunnel");
+    // the activity we just recorded keeps the owner from expiring the entry, and closing
+    // its socket, for a whole lifetime. Other workers may count for the same flow at the
+    // same time, the counters of the entry need real atomic adds here.
+    METRIC_LATENCY(METRIC_UP, rx, realtime_nanosec());
+    if (sendto(sock, buffer + MUX_HDR_SIZE, nbytes - MUX_HDR_SIZE, 0, (struct sockaddr*)&addr_service, sizeof(addr_service)) < 0) {
+        METRIC_INC(drop_send_error);
+    } else {
+        METRIC_ADD(packets_up, 1);
+        METRIC_ADD(bytes_up, nbytes - MUX_HDR_SIZE);
+        __atomic_fetch_add(&x->packets_up, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&x->bytes_up, nbytes - MUX_HDR_SIZE, __ATOMIC_RELAXED);
+    }
+}
+
+static void batch_init(batch_t* b, unsigned size) {
+    b->size = size;
+    b->slots = malloc((size_t)size * BUF_SIZE);
+    b->ctrls_in = calloc(size, UDP_CTRL_SIZE);
+    b->ctrls_out = calloc(size, UDP_CTRL_SIZE);
+    b->iovs_in = calloc(size, sizeof(struct iovec));
+    b->iovs_out = calloc(size, sizeof(struct iovec));
+    b->msgs_in = calloc(size, sizeof(struct mmsghdr));
+    b->msgs_out = calloc(size, sizeof(struct mmsghdr));
+    if (!b->slots || !b->ctrls_in || !b->ctrls_out || !b->iovs_in || !b->iovs_out || !b->msgs_in || !b->msgs_out) {
+        print_e(LOG_ERROR, "could not allocate buffers for %u datagrams", size);
         exit(EXIT_FAILURE);
     }
+    for (unsigned i = 0; i < size; ++i) {
+        b->iovs_in[i].iov_base = b->slots + (size_t)i * BUF_SIZE + MUX_HDR_SIZE;
+        b->iovs_in[i].iov_len = BUF_SIZE - MUX_HDR_SIZE;
+        b->msgs_in[i].msg_hdr.msg_iov = &b->iovs_in[i];
+        b->msgs_in[i].msg_hdr.msg_iovlen = 1;
+        b->msgs_out[i].msg_hdr.msg_iov = &b->iovs_out[i];
+        b->msgs_out[i].msg_hdr.msg_iovlen = 1;
+        b->msgs_out[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+}
 
-    while ("my guitar gently weeps") {
+/**
+ * take up to a batch of datagrams from a readable socket. This is also
+ * the fairness budget, whatever is left stays queued until the next pass
+ * over the ready sockets, epoll will report the socket again.
+ *
+ * @return number of datagrams received
+ */
+static unsigned batch_recv(batch_t* b, int sock) {
+    for (unsigned i = 0; i < b->size; ++i) {
+        b->msgs_in[i].msg_hdr.msg_control = b->ctrls_in + i * UDP_CTRL_SIZE;
+        b->msgs_in[i].msg_hdr.msg_controllen = UDP_CTRL_SIZE;
+    }
+    int n = recvmmsg(sock, b->msgs_in, b->size, MSG_DONTWAIT, NULL);
+    return (n > 0) ? n : 0;
+}
 
-        int count_sock = conn_socket_count();
-        pfds = realloc(pfds, count_sock * sizeof(struct pollfd));
-        int idx = 0;
-        conn_entry_t* e = conn_table;
-        while (e) {
-            if (e->sock_service) {
-                e->sock_service_pollidx = idx;
-                pfds[idx].events = POLLIN;
-                pfds[idx].fd = e->sock_service;
-                ++idx;
-            }
-            if (e->sock_tunnel) {
-                e->sock_tunnel_pollidx = idx;
-                pfds[idx].events = POLLIN;
-                pfds[idx].fd = e->sock_tunnel;
-                ++idx;
-            }
-            e = e->next;
+/**
+ * send received datagrams on to a single destination, all with one system
+ * call. With a flow ID header each datagram is prefixed with it.
+ *
+ * @param b the batch holding the datagrams
+ * @param count number of datagrams
+ * @param sock socket to send from
+ * @param dest destination address
+ * @param e connection entry to account the datagrams to
+ * @param dir direction to account the datagrams to
+ * @param flow flow ID to prefix each datagram with, NULL for none
+ * @param woke arrival time for datagrams without a kernel timestamp
+ */
+static void batch_send(batch_t* b, unsigned count, int sock, struct sockaddr_in* dest, conn_entry_t* e, metric_dir_t dir, const uint32_t* flow, uint64_t woke) {
+    for (unsigned i = 0; i < count; ++i) {
+        char* data = b->iovs_in[i].iov_base;
+        size_t len = b->msgs_in[i].msg_len;
+        uint16_t seg = args.gso ? udp_gro_size(&b->msgs_in[i].msg_hdr) : 0;
+        if (flow) {
+            uint32_t hdr = htonl(*flow);
+            data -= MUX_HDR_SIZE;
+            len += MUX_HDR_SIZE;
+            memcpy(data, &hdr, MUX_HDR_SIZE);
+        }
+        b->iovs_out[i].iov_base = data;
+        b->iovs_out[i].iov_len = len;
+        b->msgs_out[i].msg_hdr.msg_name = dest;
+        udp_set_gso_size(&b->msgs_out[i].msg_hdr, b->ctrls_out + i * UDP_CTRL_SIZE, seg, len);
+    }
+
+    uint64_t tx = realtime_nanosec();
+    for (unsigned i = 0; i < count; ++i) {
+        uint64_t rx = udp_rx_time(&b->msgs_in[i].msg_hdr);
+        METRIC_LATENCY(dir, rx ? rx : woke, tx);
+    }
+    METRIC_ADD(drop_send_error, udp_send_batch(sock, b->msgs_out, count));
+
+    // only what actually went out counts as forwarded
+    unsigned packets = 0;
+    size_t bytes = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        if (b->msgs_out[i].msg_len) {
+            size_t len = b->msgs_in[i].msg_len;
+            packets += METRIC_SEGMENTS(len, args.gso ? udp_gro_size(&b->msgs_in[i].msg_hdr) : 0);
+            bytes += len;
         }
+    }
+    if (dir == METRIC_UP) {
+        METRIC_FORWARD(e, up, packets, bytes);
+    } else {
+        METRIC_FORWARD(e, down, packets, bytes);
+    }
+}
+
+/**
+ * keepalive timer callback, send a keepalive over the tunnel and schedule
+ * the next one. Every nonce can only be used once, so two keepalives in
+ * the same millisecond must still get different nonces. The outside agent
+ * accepts them in any order within its replay window, so the workers only
+ * need to agree on the nonces, not on the order of sending.
+ */
+static void keepalive_due(wheel_timer_t* t) {
+    conn_entry_t* e = conn_from_keepalive_timer(t);
+    wheel_add(t->wheel, t, clock_now() + args.keepalive * 1000);
+
+    uint64_t ms = realtime_millisec();
+    uint64_t last = __atomic_load_n(&last_nonce, __ATOMIC_RELAXED);
+    uint64_t nonce;
+    do {
+        nonce = (ms > last) ? ms : last + 1;
+    } while (!__atomic_compare_exchange_n(&last_nonce, &last, nonce, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-        if (poll(pfds, count_sock, 100) < 0) {
-            print_e(LOG_ERROR, "poll returned error");
+    // the keepalive datagram is a 40 byte message authentication code, an HMAC-SHA256 over
+    // a unique nonce keyed with a pre shared secret (the -k argument). This is done to
+    // prevent spoofing of the keepalive datagrams by an attacker.
+    mac_t mac = mac_gen(NULL, 0, nonce);
+    if (sendto(e->sock_tunnel, &mac, sizeof(mac), 0, (struct sockaddr*)&addr_outside, sizeof(addr_outside)) < 0) {
+        METRIC_INC(drop_send_error);
+    } else {
+        METRIC_INC(keepalive_sent);
+    }
+}
+
+/**
+ * move one entry over to the new address of the outside host, a spare is
+ * removed and counted, everything else sends a keepalive right away
+ */
+static void migrate_entry(conn_entry_t* e, void* arg) {
+    unsigned* removed = arg;
+    if (e->sock_tunnel <= 0) {
+        return;
+    }
+    if (e->spare && !args.mux) {
+        conn_table_remove(e);
+        ++*removed;
+        return;
+    }
+    wheel_timer_t* t = conn_keepalive_timer(e);
+    wheel_add(t->wheel, t, clock_now());
+}
+
+/**
+ * the outside host has a new address. The tunnels of this worker keep
+ * their sockets and send their next keepalive right away to the new
+ * address, that tells the outside agent there where they are and opens
+ * the NAT towards it. The spares are replaced with fresh ones, the old
+ * ones may already be promised to clients at the old address. The shared
+ * tunnels of the multiplexed mode are never replaced.
+ */
+static void migrate(worker_t* self) {
+    unsigned removed = 0;
+    self->moved = false;
+    conn_lock();
+    addr_outside = addr_outside_resolved;
+    conn_table_foreach_owned(migrate_entry, &removed);
+    conn_unlock();
+    print(LOG_DEBUG, "worker %u moved its tunnels, replacing %u spare(s)", self->id, removed);
+    while (removed--) {
+        create_spare(self);
+    }
+    conn_lock();
+    conn_print_numbers();
+    conn_unlock();
+}
+
+/**
+ * resolver callback, hand the new address of the outside host to all workers
+ */
+static void outside_moved(struct in_addr addr) {
+    conn_lock();
+    addr_outside_resolved.sin_addr = addr;
+    conn_unlock();
+    uint64_t one = 1;
+    for (unsigned i = 0; i < args.threads; ++i) {
+        if (write(workers[i].mvfd, &one, sizeof(one)) < 0) {
+            print_e(LOG_ERROR, "could not notify worker %u of the new outside address", i);
+        }
+    }
+}
+
+static void* run_worker(void* arg) {
+    worker_t* w = arg;
+    batch_t* b = &w->batch;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    if (args.cpu_count) {
+        pin_to_cpu(args.cpus[w->id % args.cpu_count]);
+    }
+    wheel_init(&w->wheel, clock_update());
+    conn_lock();
+    addr_outside = addr_outside_resolved;
+    conn_unlock();
+    conn_table_set_worker(w->epfd, &w->wheel);
+    metrics_register();
+    batch_init(b, args.batch);
+
+    if (args.mux) {
+        // the shared tunnels stay spare forever, that keeps them from expiring,
+        // and they are spread across the workers like the regular spares
+        for (unsigned k = w->id; k < args.mux; k += args.threads) {
+            create_spare(w);
+        }
+    } else if (w->id == 0) {
+        // we start out with a pool of unused spare tunnels
+        print(LOG_INFO, "creating %u initial outgoing tunnel(s)", args.spares);
+        for (unsigned k = 0; k < args.spares; ++k) {
+            request_spare();
+        }
+    }
+
+    while ("my guitar gently weeps") {
+
+        // sleep until there is data or the next keepalive or expiry is due
+        int count_events = epoll_wait(w->epfd, events, EPOLL_MAX_EVENTS, wheel_timeout(&w->wheel, clock_now()));
+        clock_update();
+        if (count_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            print_e(LOG_ERROR, "epoll_wait returned error");
             exit(EXIT_FAILURE);
         };
 
-        e = conn_table;
-        while (e) {
+        // datagrams without a kernel timestamp count as arrived when we woke up
+        uint64_t woke = (count_events > 0) ? realtime_nanosec() : 0;
 
-            // check all the sockets facing towards the service host
-            if (e->sock_service > 0) {
-                if (pfds[e->sock_service_pollidx].revents & POLLIN) {
-                    nbytes = recvfrom(e->sock_service, buffer, BUF_SIZE, 0, (struct sockaddr*) &addr_incoming, &len_addr);
-                    if (e->sock_tunnel > 0) {
-                        sendto(e->sock_tunnel, buffer, nbytes, 0, (struct sockaddr*)&addr_outside, len_addr);
-                    }
+        for (int i = 0; i < count_events; ++i) {
+            conn_sock_kind_t kind;
+            conn_entry_t* e = conn_from_event(&events[i], &kind);
+
+            // a NULL entry is one of our eventfds, the outside host moved
+            if ((e == NULL) && (kind == CONN_SOCK_TUNNEL)) {
+                uint64_t moved;
+                if (read(w->mvfd, &moved, sizeof(moved)) == sizeof(moved)) {
+                    w->moved = true;
                 }
+                continue;
             }
 
-            // check all the sockets facing towards the tunnel outside agent
-            if (e->sock_tunnel > 0) {
-                if (pfds[e->sock_tunnel_pollidx].revents & POLLIN) {
-                    nbytes = recvfrom(e->sock_tunnel, buffer, BUF_SIZE, 0, (struct sockaddr*) &addr_incoming, &len_addr);
-                    if (e->spare) {
-                        // this came in on one of the spare connections
-                        // remove the spare status and create a socket to use it
-                        print(LOG_INFO, "new client data arrived on spare tunnel, creating socket for it");
-                        e->spare = false;
-                        e->sock_service = socket(AF_INET, SOCK_DGRAM, 0);
-                        if (e->sock_service < 0) {
-                            print_e(LOG_ERROR, "could not create new UDP socket for service");
-                            exit(EXIT_FAILURE);
-                        }
-
-                        // and immediately create another new spare connection
-                        print(LOG_DEBUG, "creating new outgoing spare tunnel");
-                        conn_entry_t* spare_conn = conn_table_insert();
-                        spare_conn->spare = true;
-                        spare_conn->sock_tunnel = socket(AF_INET, SOCK_DGRAM, 0);
-                        if (e->sock_tunnel < 0) {
-                            print_e(LOG_ERROR, "could not create UDP socket for new spare connectionl");
-                            exit(EXIT_FAILURE);
-                        }
-
-                        conn_print_numbers();
+            // or a worker (maybe this one) wants us to create spare tunnels
+            if (e == NULL) {
+                uint64_t requested;
+                if (read(w->evfd, &requested, sizeof(requested)) == sizeof(requested)) {
+                    while (requested--) {
+                        create_spare(w);
                     }
+                }
+                continue;
+            }
 
-                    if (e->sock_service > 0) {
-                        sendto(e->sock_service, buffer, nbytes, 0, (struct sockaddr*)&addr_service, len_addr);
-                        e->last_acticity = millisec();
-                    }
+            // data from the service for a multiplexed flow, prefix it with the flow ID
+            if ((kind == CONN_SOCK_SERVICE) && args.mux) {
+                unsigned n = batch_recv(b, e->sock_service);
+                if (n) {
+                    conn_extra_t* x = conn_extra(e);
+                    conn_lock();
+                    int sock = conn_table_get(x->mux)->sock_tunnel;
+                    conn_unlock();
+                    batch_send(b, n, sock, &addr_outside, e, METRIC_DOWN, &x->flow, woke);
+                }
+                continue;
+            }
+
+            // data from one of the sockets facing towards the service host
+            if (kind == CONN_SOCK_SERVICE) {
+                unsigned n = batch_recv(b, e->sock_service);
+                if (n && (e->sock_tunnel > 0)) {
+                    batch_send(b, n, e->sock_tunnel, &addr_outside, e, METRIC_DOWN, NULL, woke);
                 }
+                continue;
             }
 
-            e = e->next;
+            // data from one of the sockets facing towards the tunnel outside agent
+            unsigned n = batch_recv(b, e->sock_tunnel);
+            if (n == 0) {
+                continue;
+            }
+            if (args.mux) {
+                for (unsigned k = 0; k < n; ++k) {
+                    uint64_t rx = udp_rx_time(&b->msgs_in[k].msg_hdr);
+                    forward_mux(e, b->iovs_in[k].iov_base, b->msgs_in[k].msg_len, rx ? rx : woke);
+                }
+                continue;
+            }
+            if (e->spare) {
+                // this came in on one of the spare connections
+                // remove the spare status and create a socket to use it
+                print(LOG_INFO, "new client data arrived on spare tunnel, creating socket for it");
+                conn_lock();
+                conn_set_spare(e, false);
+                conn_unlock();
+                e->sock_service = socket(AF_INET, SOCK_DGRAM, 0);
+                if (e->sock_service < 0) {
+                    print_e(LOG_ERROR, "could not create new UDP socket for service");
+                    exit(EXIT_FAILURE);
+                }
+                if (args.gso) {
+                    udp_enable_gro(e->sock_service);
+                }
+                udp_enable_timestamps(e->sock_service);
+                conn_watch_socket(e, CONN_SOCK_SERVICE);
+
+                // and refill the pool of spare connections
+                print(LOG_DEBUG, "creating new outgoing spare tunnel");
+                request_spare();
+                conn_lock();
+                conn_print_numbers();
+                conn_unlock();
+            }
+
+            if (e->sock_service > 0) {
+                batch_send(b, n, e->sock_service, &addr_service, e, METRIC_UP, NULL, woke);
+                e->last_acticity = clock_now();
+            }
+        }
+
+        // not in the middle of the events, they may belong to spares that get replaced
+        if (w->moved) {
+            migrate(w);
         }
 
         // in regular intervals we need to send a keepalive datagram to the outside agent. This has the
         // purpose of punching a hole into the NAT and keeping it open, and it also tells the outside
         // agent the public address and port of that hole, so it can send datagrams back to the inside.
-        e = conn_table;
-        uint64_t ms = millisec();
-        while (e) {
-            if (e->sock_tunnel > 0) {
-                if (ms - e->last_keepalive > args.keepalive * 1000) {
-                    e->last_keepalive = ms;
-
-                    // the keepalive datagram is a 40 byte message authentication code, based on the sha-256 over
-                    // a strictly increasing nonce and a pre shared secret (the -k argument). This is done to
-                    // prevent spoofing of the keepalive datagrams by an attacker.
-                    mac_t mac = mac_gen(NULL, 0, ms);
-                    sendto(e->sock_tunnel, &mac, sizeof(mac), 0, (struct sockaddr*)&addr_outside, len_addr);
-                    break; // only send one keepalive per select iteration to spread them out in time
-                }
-            }
-            e = e->next;
-        }
+        // Stale inactive connections are removed from the connection table and their sockets closed.
+        // Both is driven by the timers of the entries.
+        conn_lock();
+        wheel_advance(&w->wheel, clock_now());
+        conn_unlock();
 
-        // remove any stale inactive connections from the connection table and close their sockets.
-        conn_table_clean(CONN_LIFETIME_SECONDS, false);
+        // expired entries might have made room for the spares we could not create before
+        unsigned missing = w->spares_missing;
+        w->spares_missing = 0;
+        while (missing--) {
+            create_spare(w);
+        }
     }
+    return NULL;
 }
 
+void run_inside(args_parsed_t parsed) {
+    args = parsed;
+
+    print(LOG_INFO, "UDP tunnel inside agent v" VERSION_STR);
+    print(LOG_INFO, "building tunnels to outside agent at %s, port %d", args.outside_host, args.outside_port);
+    print(LOG_INFO, "forwarding incomimg UDP to %s, port %d", args.service_host, args.service_port);
+
+    if (!resolve_host(args.outside_host, &addr_outside_resolved.sin_addr)) {
+        exit(EXIT_FAILURE);
+    }
+    addr_outside_resolved.sin_family = AF_INET;
+    addr_outside_resolved.sin_port = htons(args.outside_port);
+
+    if (!resolve_host(args.service_host, &addr_service.sin_addr)) {
+        exit(EXIT_FAILURE);
+    }
+    addr_service.sin_family = AF_INET;
+    addr_service.sin_port = htons(args.service_port);
+
+    conn_table_set_lifetime(CONN_LIFETIME_SECONDS, false);
+    if (args.max_conns) {
+        conn_table_set_capacity(args.max_conns);
+    }
+
+    workers = calloc(args.threads, sizeof(worker_t));
+    for (unsigned i = 0; i < args.threads; ++i) {
+        workers[i].id = i;
+        workers[i].epfd = epoll_create1(0);
+        if (workers[i].epfd < 0) {
+            print_e(LOG_ERROR, "could not create epoll instance");
+            exit(EXIT_FAILURE);
+        }
+        workers[i].evfd = eventfd(0, EFD_NONBLOCK);
+        if (workers[i].evfd < 0) {
+            print_e(LOG_ERROR, "could not create eventfd");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.u64 = 0
+        };
+        epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].evfd, &ev);
+        workers[i].mvfd = eventfd(0, EFD_NONBLOCK);
+        if (workers[i].mvfd < 0) {
+            print_e(LOG_ERROR, "could not create eventfd");
+            exit(EXIT_FAILURE);
+        }
+        ev.data.u64 = CONN_SOCK_TUNNEL;
+        epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].mvfd, &ev);
+    }
+
+    if (args.threads > 1) {
+        print(LOG_INFO, "distributing client connections among %u workers", args.threads);
+    }
+    if (args.mux) {
+        print(LOG_INFO, "multiplexing all clients over %u tunnels", args.mux);
+    }
+    metrics_watch_signal();
+    if (args.metrics) {
+        metrics_serve(args.metrics);
+    }
+    resolve_watch(args.outside_host, addr_outside_resolved.sin_addr, args.resolve, outside_moved);
+    for (unsigned i = 1; i < args.threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            print_e(LOG_ERROR, "could not start worker thread %u", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    run_worker(&workers[0]);
+}
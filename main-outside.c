@@ -1,115 +1,1092 @@
+#define _GNU_SOURCE
 #include "main-outside.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
 
 #include "connlist.h"
 #include "mac.h"
+#include "metrics.h"
 #include "misc.h"
 #include "defines.h"
+#include "udp.h"
+#include "pending.h"
+#include "preauth.h"
+#include "sha-256.h"
+#include "xdp.h"
+#ifdef HAVE_URING
+#include "uring.h"
+#endif
 
-void run_outside(args_parsed_t args) {
+/**
+ * buffers of a worker for receiving and sending a batch of datagrams
+ */
+typedef struct {
+    unsigned size;
+    char* buffers;
+    struct iovec* iovs_in;
+    struct iovec* iovs_out;
+    struct sockaddr_in* addrs_in;
+    struct sockaddr_in* addrs_out;
+    struct mmsghdr* msgs_in;
+    struct mmsghdr* msgs_out;
+    char* ctrls_in;
+    char* ctrls_out;
+    uint64_t* rx_out;
+    metric_dir_t* dirs_out;
+} batch_t;
+
+typedef struct {
+    pthread_t thread;
+    unsigned id;
     int sockfd;
-    char buffer[BUF_SIZE];
-    struct sockaddr_in addr_own = {0};
-    struct sockaddr_in addr_incoming = {0};
-    uint64_t time_last_cleanup = 0;
-    bool log_client_connections = true;
+    int epfd;                   // with connected sockets: the listening socket and the adopted flows
+    args_parsed_t* args;
+    timer_wheel_t* wheel;       // the wheel whose timers this worker runs
+    timer_wheel_t own_wheel;    // with connected sockets every worker has its own
+    batch_t batch;
+    uint64_t time_last_cleanup;
+    uint64_t time_last_stats;
+    uint64_t time_last_sync;
+    uint64_t stat_calls;
+    uint64_t stat_datagrams;
+} worker_t;
 
-    print(LOG_INFO, "UDP tunnel outside agent v" VERSION_STR);
+static bool log_client_connections = true;
+static timer_wheel_t wheel;
+static bool mux = false;
+static uint32_t next_flow;
+static bool fast_path = false;
+static __thread struct sockaddr_in* fast_path_gone = NULL;  // addresses to take out of the XDP program after unlocking
+static __thread unsigned fast_path_gone_count = 0;
+static __thread unsigned fast_path_gone_size = 0;
+static args_parsed_t* settings;
 
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        print_e(LOG_ERROR, "socket creation failed");
+static void connect_flow(conn_entry_t* conn);
+
+/**
+ * hand a client that has just been paired with its tunnel over to the
+ * XDP program, from now on it forwards their datagrams in both directions
+ * and only keepalives still reach us. Must be called with the lock held.
+ */
+static void fast_path_add(conn_entry_t* conn) {
+    if (!fast_path) {
+        return;
+    }
+    if (!xdp_add(&conn->addr_client, &conn->addr_tunnel) || !xdp_add(&conn->addr_tunnel, &conn->addr_client)) {
+        xdp_del(&conn->addr_client);
+        print(LOG_DEBUG, "XDP flow map is full, client %s:%d stays on the regular path", inet_ntoa(conn->addr_client.sin_addr), conn->addr_client.sin_port);
+    }
+}
+
+/**
+ * connection table callback, take a removed client out of the XDP program.
+ * Called with the lock held, possibly for many entries in one expiry run,
+ * so the addresses are only queued and fast_path_flush() deletes them
+ * from the map after the lock has been released.
+ */
+static void fast_path_remove(conn_entry_t* conn) {
+    if (conn->addr_client.sin_family != AF_INET) {
+        return;
+    }
+    if (fast_path_gone_count + 2 > fast_path_gone_size) {
+        unsigned size = fast_path_gone_size ? 2 * fast_path_gone_size : 64;
+        struct sockaddr_in* gone = realloc(fast_path_gone, size * sizeof(struct sockaddr_in));
+        if (gone == NULL) {
+            print(LOG_WARN, "could not queue a removed client for the XDP program, deleting it right away");
+            xdp_del(&conn->addr_client);
+            xdp_del(&conn->addr_tunnel);
+            return;
+        }
+        fast_path_gone = gone;
+        fast_path_gone_size = size;
+    }
+    fast_path_gone[fast_path_gone_count++] = conn->addr_client;
+    fast_path_gone[fast_path_gone_count++] = conn->addr_tunnel;
+}
+
+/**
+ * delete what fast_path_remove() has queued by the calling thread from the
+ * map of the XDP program, to be called without the lock held. Should the
+ * same client have been paired again in between, it just loses the fast
+ * path and stays on the regular one.
+ */
+static void fast_path_flush(void) {
+    for (unsigned i = 0; i < fast_path_gone_count; ++i) {
+        xdp_del(&fast_path_gone[i]);
+    }
+    fast_path_gone_count = 0;
+}
+
+/**
+ * add what the XDP program has forwarded since the last call to the
+ * counters of the connections and of the calling thread
+ */
+static void fast_path_sync(void) {
+    const xdp_flow_t* flows;
+    unsigned count = xdp_read(&flows);
+    conn_lock();
+    for (unsigned i = 0; i < count; ++i) {
+        metric_dir_t dir = METRIC_UP;
+        conn_entry_t* conn = conn_table_find_client_address((struct sockaddr_in*)&flows[i].from);
+        if (conn == NULL) {
+            dir = METRIC_DOWN;
+            conn = conn_table_find_tunnel_address((struct sockaddr_in*)&flows[i].from);
+        }
+        conn_extra_t* x = conn ? conn_extra(conn) : NULL;
+        if ((x == NULL) || (flows[i].packets == x->xdp_packets[dir])) {
+            continue;
+        }
+        uint64_t packets = flows[i].packets - x->xdp_packets[dir];
+        uint64_t bytes = flows[i].bytes - x->xdp_bytes[dir];
+        x->xdp_packets[dir] = flows[i].packets;
+        x->xdp_bytes[dir] = flows[i].bytes;
+        if (dir == METRIC_UP) {
+            METRIC_FORWARD(conn, up, packets, bytes);
+        } else {
+            METRIC_FORWARD(conn, down, packets, bytes);
+        }
+    }
+    conn_unlock();
+}
+
+/**
+ * decide what to do with a datagram that has arrived on the listening socket.
+ * Keepalives from the inside agent are consumed here, everything else is
+ * either forwarded from a tunnel to its client or from a client into its
+ * tunnel.
+ *
+ * Datagrams of new clients arriving while there is no spare tunnel are
+ * held until the next tunnel registers and then sent into it right away.
+ *
+ * In multiplexed mode the flow ID header is stripped from datagrams coming
+ * out of a tunnel and prepended to datagrams going into one, the caller
+ * must leave MUX_HDR_SIZE bytes of room in front of the payload for this.
+ *
+ * @param addr_incoming source address of the datagram
+ * @param data pointer to the payload, will be adjusted to the datagram to send
+ * @param len length of the payload, will be adjusted to the datagram to send
+ * @param seg segment size if the payload is a train of datagrams, otherwise 0
+ * @param mac_valid verification result for a keepalive sized datagram, or NULL to verify it here
+ * @param dir will receive the direction the datagram is forwarded in
+ * @return pointer to the address the datagram must be forwarded to, or NULL if it must not be forwarded
+ */
+static struct sockaddr_in* route(struct sockaddr_in* addr_incoming, char** data, size_t* len, uint16_t seg, const bool* mac_valid, metric_dir_t* dir) {
+    size_t nbytes = *len;
+    // the keepalive datagram from the inside agent is a 40 byte message authentication code
+    // for an empty message with a strictly increasing nonce, each code can only be used
+    // exactly once) to prevent replay attacks. This datagram is used to learn the public
+    // address and port of the inside agent.
+    if (nbytes == sizeof(mac_t)) {
+        mac_t mac;
+        memcpy(&mac, *data, sizeof(mac_t));
+        bool valid;
+        if (mac_valid) {
+            valid = *mac_valid;
+        } else {
+            valid = preauth_check(addr_incoming, mac.nonce, conn_table_find_tunnel_address(addr_incoming) != NULL);
+            if (valid) {
+                valid = mac_test(NULL, 0, mac);
+                preauth_result(valid);
+            }
+        }
+        if (valid) {
+            // We could successfully verify the authentication code, we know this datagram
+            // originates from the inside agent and we can store the source address.
+            // From this moment on we know where to forward the client datagrams.
+            conn_entry_t* conn = conn_table_find_tunnel_address(addr_incoming);
+            if (!conn) {
+                print(LOG_DEBUG, "new incoming reverse tunnel from: %s:%d", inet_ntoa(addr_incoming->sin_addr), addr_incoming->sin_port);
+                conn = conn_table_insert();
+                if (conn == NULL) {
+                    METRIC_INC(drop_table_full);
+                    print(LOG_WARN, "connection table is full, ignoring new tunnel");
+                    return NULL;
+                }
+                conn_set_tunnel_address(conn, addr_incoming);
+                conn_set_spare(conn, true);
+
+                // a new client might already be waiting for this tunnel
+                struct sockaddr_in client;
+                unsigned count;
+                size_t bytes;
+                if (!mux && pending_flush_oldest(addr_incoming, &client, &count, &bytes, clock_now())) {
+                    conn_set_spare(conn, false);
+                    conn_set_client_address(conn, &client);
+                    METRIC_FORWARD(conn, up, count, bytes);
+                    fast_path_add(conn);
+                    connect_flow(conn);
+                }
+                conn_print_numbers();
+                log_client_connections = true;
+            }
+            conn->last_acticity = clock_now();
+            return NULL;
+        }
+    }
+
+    // Test whether this originates from the inside agent. All possible inside agent
+    // tunnel addresses must be present in our connection table.
+    conn_entry_t* conn = conn_table_find_tunnel_address(addr_incoming);
+    if (conn) {
+        if (mux) {
+            // one of the shared tunnels, the flow ID tells us the client
+            uint32_t flow;
+            if (nbytes < MUX_HDR_SIZE) {
+                return NULL;
+            }
+            memcpy(&flow, *data, MUX_HDR_SIZE);
+            conn = conn_table_find_flow(ntohl(flow));
+            if (!conn) {
+                return NULL;
+            }
+            conn->last_acticity = clock_now();
+            *data += MUX_HDR_SIZE;
+            *len -= MUX_HDR_SIZE;
+        }
+        METRIC_FORWARD(conn, down, METRIC_SEGMENTS(*len, seg), *len);
+        *dir = METRIC_DOWN;
+        return &conn->addr_client;
+    }
+
+    // This is not from one of the known tunnel addresses, so it must be from a client.
+    conn = conn_table_find_client_address(addr_incoming);
+    if (mux && conn_spare_count()) {
+        // In multiplexed mode the spares are the shared tunnels, they are never handed
+        // out to a client. Instead every client gets a flow ID and the flow is mapped to
+        // one of the tunnels, any tunnel would do since the inside agent only looks at
+        // the flow ID, but as long as the tunnels don't change a flow sticks to one.
+        if (conn == NULL) {
+            if (log_client_connections) {
+                print(LOG_INFO, "new client conection from %s:%d", inet_ntoa(addr_incoming->sin_addr), addr_incoming->sin_port);
+            }
+            conn = conn_table_insert();
+            if (conn == NULL) {
+                METRIC_INC(drop_table_full);
+                print(LOG_WARN, "connection table is full, dropping package");
+                return NULL;
+            }
+            conn_set_client_address(conn, addr_incoming);
+            conn_set_flow(conn, next_flow++);
+            conn_print_numbers();
+        }
+        conn->last_acticity = clock_now();
+        METRIC_FORWARD(conn, up, 1, nbytes);
+        *dir = METRIC_UP;
+        uint32_t id = conn_extra(conn)->flow;
+        uint32_t flow = htonl(id);
+        *data -= MUX_HDR_SIZE;
+        *len += MUX_HDR_SIZE;
+        memcpy(*data, &flow, MUX_HDR_SIZE);
+        return &conn_table_find_spare(id % conn_spare_count())->addr_tunnel;
+    }
+    if (mux) {
+        conn = NULL;
+    } else if (conn == NULL) {
+        if (log_client_connections) {
+            print(LOG_INFO, "new client conection from %s:%d", inet_ntoa(addr_incoming->sin_addr), addr_incoming->sin_port);
+        }
+
+        // now try to find a spare tunnel for this new client and activate it
+        conn = conn_table_find_next_spare();
+        if (conn) {
+            conn_set_spare(conn, false);
+            conn_set_client_address(conn, addr_incoming);
+            fast_path_add(conn);
+            connect_flow(conn);
+
+            // whatever it sent while it was waiting goes first, through the same tunnel
+            unsigned count;
+            size_t bytes;
+            if (pending_take(addr_incoming, &conn->addr_tunnel, &count, &bytes, clock_now())) {
+                METRIC_FORWARD(conn, up, count, bytes);
+            }
+        }
+    }
+
+    // if we have a tunnel conection for this client then we can forward it to the inside
+    if (conn) {
+        METRIC_FORWARD(conn, up, METRIC_SEGMENTS(nbytes, seg), nbytes);
+        *dir = METRIC_UP;
+        return &conn->addr_tunnel;
+    }
+    if (!mux && pending_add(addr_incoming, *data, nbytes, clock_now())) {
+        return NULL;
+    }
+    METRIC_INC(drop_no_tunnel);
+    if (log_client_connections) {
+        print(LOG_WARN, "could not find tunnel connection for client, dropping package");
+        print(LOG_DEBUG, "will not repeat above warning until inside agent connects again");
+        log_client_connections = false;
+    }
+    return NULL;
+}
+
+/**
+ * send all prepared datagrams and count how long each of them has been
+ * in our hands. One clock reading covers the whole batch.
+ *
+ * @param rx arrival times of the datagrams
+ * @param dirs directions the datagrams are forwarded in
+ */
+static void send_with_latency(int sockfd, struct mmsghdr* msgs, uint64_t* rx, metric_dir_t* dirs, unsigned count) {
+    if (count == 0) {
+        return;
+    }
+    uint64_t tx = realtime_nanosec();
+    for (unsigned i = 0; i < count; ++i) {
+        METRIC_LATENCY(dirs[i], rx[i], tx);
+    }
+    METRIC_ADD(drop_send_error, udp_send_batch(sockfd, msgs, count));
+}
+
+/**
+ * attach a classic BPF program to the reuseport group which selects the
+ * socket by a hash over source address and port, so that every flow always
+ * lands on the same worker, independent of sockets joining or leaving the
+ * group. This assumes IPv4 headers, which is all we are listening on.
+ */
+static void attach_steering(int sockfd, unsigned count) {
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SKF_NET_OFF),       // X = IP header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF),        // A = UDP source port
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),                        // X = A
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),   // A = IP source address
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code
+    };
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        print_e(LOG_ERROR, "could not attach BPF steering program");
         exit(EXIT_FAILURE);
     }
+}
+
+/**
+ * open a socket bound to the listen port. When running more than one
+ * worker all of them share the port through SO_REUSEPORT and the kernel
+ * distributes the incoming datagrams among them. A socket for a single
+ * peer joins the same group and is connected to the peer, the kernel
+ * then prefers it for datagrams from that peer.
+ *
+ * @param peer address to connect to, NULL for a listening socket
+ * @return socket or -1 on error
+ */
+static int open_socket(args_parsed_t* args, struct sockaddr_in* peer) {
+    int sockfd;
+    struct sockaddr_in addr_own = {0};
+
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        return -1;
+    }
+
+    // the io_uring datapath does not ask for the segment size, it must only ever see single datagrams
+    if (args->gso && !args->uring) {
+        udp_enable_gro(sockfd);
+    }
+    if (!args->uring) {
+        udp_enable_timestamps(sockfd);
+    }
 
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 500 * 1000;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    if ((args->threads > 1) || args->connected) {
+        int one = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+            close(sockfd);
+            return -1;
+        }
+    }
 
     addr_own.sin_family = AF_INET;
     addr_own.sin_addr.s_addr = INADDR_ANY;
-    addr_own.sin_port = htons(args.listenport);
+    addr_own.sin_port = htons(args->listenport);
+
+    if ((bind(sockfd, (const struct sockaddr *)&addr_own, sizeof(addr_own)) < 0)
+            || (peer && (connect(sockfd, (struct sockaddr*)peer, sizeof(struct sockaddr_in)) < 0))) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
 
-    if (bind(sockfd, (const struct sockaddr *)&addr_own, sizeof(addr_own)) < 0) {
-        print_e(LOG_ERROR, "binding to port %d failed", args.listenport);
+static int create_socket(args_parsed_t* args) {
+    int sockfd = open_socket(args, NULL);
+    if (sockfd < 0) {
+        print_e(LOG_ERROR, "could not open a socket on port %d", args->listenport);
         exit(EXIT_FAILURE);
     }
+    return sockfd;
+}
 
-    print(LOG_INFO, "listening on port %d", args.listenport);
+/**
+ * give a client that has just been paired with its tunnel a connected
+ * socket for each side. The calling worker adopts the entry, it serves
+ * both sockets and is the one that expires the entry and closes them.
+ * Without sockets the flow simply stays on the listening sockets. Must
+ * be called with the lock held.
+ */
+static void connect_flow(conn_entry_t* conn) {
+    if (!settings->connected) {
+        return;
+    }
+    conn->sock_tunnel = open_socket(settings, &conn->addr_tunnel);
+    conn->sock_service = (conn->sock_tunnel < 0) ? -1 : open_socket(settings, &conn->addr_client);
+    if (conn->sock_service < 0) {
+        print_e(LOG_WARN, "could not open connected sockets for client %s:%d", inet_ntoa(conn->addr_client.sin_addr), conn->addr_client.sin_port);
+        if (conn->sock_tunnel >= 0) {
+            close(conn->sock_tunnel);
+        }
+        conn->sock_tunnel = 0;
+        conn->sock_service = 0;
+        return;
+    }
+    conn_table_adopt(conn);
+    conn_watch_socket(conn, CONN_SOCK_TUNNEL);
+    conn_watch_socket(conn, CONN_SOCK_SERVICE);
+}
 
-    socklen_t len_addr = sizeof(addr_incoming);
+/**
+ * how long the worker may sleep. Without connected sockets worker 0
+ * drives the expiry timers of the whole connection table and must wake
+ * up when the next one is due, the others can sleep until data arrives.
+ * With them every worker expires the entries it has adopted.
+ *
+ * @param w the calling worker
+ * @return milliseconds or -1 for no timeout
+ */
+static int sleep_time(worker_t* w) {
+    if ((w->wheel == &wheel) && (w->id != 0)) {
+        return -1;
+    }
+    conn_lock();
+    int timeout = wheel_timeout(w->wheel, clock_now());
+    conn_unlock();
 
-    while ("my guitar gently weeps") {
-        ssize_t nbytes = recvfrom(sockfd, buffer, BUF_SIZE, MSG_WAITALL, (struct sockaddr*) &addr_incoming, &len_addr);
-        if (nbytes > 0) {
-            // the keepalive datagram from the inside agent is a 40 byte message authentication code
-            // for an empty message with a strictly increasing nonce, each code can only be used
-            // exactly once) to prevent replay attacks. This datagram is used to learn the public
-            // address and port of the inside agent.
-            if (nbytes == sizeof(mac_t)) {
-                mac_t mac;
-                memcpy(&mac, buffer, sizeof(mac_t));
-                if (mac_test(NULL, 0, mac)) {
-                    // We could successfully verify the authentication code, we know this datagram
-                    // originates from the inside agent and we can store the source address.
-                    // From this moment on we know where to forward the client datagrams.
-                    conn_entry_t* conn = conn_table_find_tunnel_address(&addr_incoming);
-                    if (!conn) {
-                        print(LOG_DEBUG, "new incoming reverse tunnel from: %s:%d", inet_ntoa(addr_incoming.sin_addr), addr_incoming.sin_port);
-                        conn = conn_table_insert();
-                        memcpy(&conn->addr_tunnel, &addr_incoming, len_addr);
-                        conn->spare = true;
-                        conn_print_numbers();
-                        log_client_connections = true;
-                    }
-                    conn->last_acticity = millisec();
-                    continue;
-                }
+    // with an empty wheel another worker might insert the first entry while we sleep
+    if (timeout < 0) {
+        timeout = 1000;
+    }
+    // datagrams on the fast path don't wake us, but their counters must be collected
+    if (fast_path && (w->id == 0) && (timeout > XDP_SYNC_MS)) {
+        timeout = XDP_SYNC_MS;
+    }
+    return timeout;
+}
+
+/**
+ * periodic work that has to be done by every worker loop after it has
+ * processed its datagrams.
+ *
+ * @param w the calling worker
+ * @param batch maximum number of datagrams per wakeup, for the statistics
+ */
+static void housekeeping(worker_t* w, unsigned batch) {
+    uint64_t ms = clock_now();
+    if ((w->id == 0) || (w->wheel != &wheel)) {
+        conn_lock();
+        wheel_advance(w->wheel, ms); // removal of stale entries
+        conn_unlock();
+        fast_path_flush();
+    }
+    if (w->id == 0) {
+        if (fast_path && (ms - w->time_last_sync >= XDP_SYNC_MS)) {
+            w->time_last_sync = ms;
+            fast_path_sync();
+        }
+    }
+    if (ms - w->time_last_stats > 60000) {
+        w->time_last_stats = ms;
+        if (w->stat_calls) {
+            print(LOG_DEBUG, "worker %u received %lu datagrams in %lu calls, average batch fill %.1f of %u",
+                w->id, w->stat_datagrams, w->stat_calls, (double)w->stat_datagrams / w->stat_calls, batch);
+            w->stat_calls = 0;
+            w->stat_datagrams = 0;
+        }
+        if (w->id == 0) {
+            conn_lock();
+            pending_print_stats(ms);
+            preauth_print_stats();
+            conn_unlock();
+        }
+    }
+}
+
+/**
+ * Received datagrams stay in their buffer, the outgoing messages only point to them,
+ * together with a copy of the destination address decided by route(). There is room
+ * for a flow ID header in front of each datagram.
+ */
+static void batch_init(batch_t* b, unsigned size) {
+    b->size = size;
+    b->buffers = malloc((size_t)size * BUF_SIZE);
+    b->iovs_in = calloc(size, sizeof(struct iovec));
+    b->iovs_out = calloc(size, sizeof(struct iovec));
+    b->addrs_in = calloc(size, sizeof(struct sockaddr_in));
+    b->addrs_out = calloc(size, sizeof(struct sockaddr_in));
+    b->msgs_in = calloc(size, sizeof(struct mmsghdr));
+    b->msgs_out = calloc(size, sizeof(struct mmsghdr));
+    b->ctrls_in = calloc(size, UDP_CTRL_SIZE);
+    b->ctrls_out = calloc(size, UDP_CTRL_SIZE);
+    b->rx_out = calloc(size, sizeof(uint64_t));
+    b->dirs_out = calloc(size, sizeof(metric_dir_t));
+    if (!b->buffers || !b->iovs_in || !b->iovs_out || !b->addrs_in || !b->addrs_out || !b->msgs_in || !b->msgs_out
+            || !b->ctrls_in || !b->ctrls_out || !b->rx_out || !b->dirs_out) {
+        print_e(LOG_ERROR, "could not allocate buffers for %u datagrams", size);
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < size; ++i) {
+        b->iovs_in[i].iov_base = b->buffers + (size_t)i * BUF_SIZE + MUX_HDR_SIZE;
+        b->iovs_in[i].iov_len = BUF_SIZE - MUX_HDR_SIZE;
+        b->msgs_in[i].msg_hdr.msg_iov = &b->iovs_in[i];
+        b->msgs_in[i].msg_hdr.msg_iovlen = 1;
+        b->msgs_in[i].msg_hdr.msg_name = &b->addrs_in[i];
+        b->msgs_out[i].msg_hdr.msg_iov = &b->iovs_out[i];
+        b->msgs_out[i].msg_hdr.msg_iovlen = 1;
+        b->msgs_out[i].msg_hdr.msg_name = &b->addrs_out[i];
+        b->msgs_out[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+}
+
+/**
+ * take whatever is queued on a socket, up to a batch
+ *
+ * @return number of datagrams or negative on error
+ */
+static int batch_recv(batch_t* b, int sockfd) {
+    for (unsigned i = 0; i < b->size; ++i) {
+        b->msgs_in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        b->msgs_in[i].msg_hdr.msg_control = b->ctrls_in + i * UDP_CTRL_SIZE;
+        b->msgs_in[i].msg_hdr.msg_controllen = UDP_CTRL_SIZE;
+    }
+    return recvmmsg(sockfd, b->msgs_in, b->size, MSG_DONTWAIT, NULL);
+}
+
+/**
+ * handle a single datagram (or a train of them) the regular way and send
+ * it from the listening socket of the worker. A train of keepalive sized
+ * datagrams is taken apart, every one of them could be a keepalive. The
+ * pieces are routed with the lock held, a batch at a time, and sent after
+ * it is released. Uses the outgoing messages of the batch, they must not
+ * hold anything that has not been sent yet.
+ */
+static void route_and_send(worker_t* w, struct sockaddr_in* addr, char* data, size_t len, uint16_t seg, uint64_t rx) {
+    batch_t* b = &w->batch;
+    size_t step = ((seg == sizeof(mac_t)) && (len > seg)) ? seg : len;
+    size_t offs = 0;
+    do {
+        unsigned count_out = 0;
+        conn_lock();
+        for (; (offs < len) && (count_out < b->size); offs += step) {
+            size_t n = (len - offs < step) ? len - offs : step;
+            uint16_t s = (step == len) ? seg : 0;
+            char* p = data + offs;
+            metric_dir_t dir;
+            struct sockaddr_in* dest = route(addr, &p, &n, s, NULL, &dir);
+            if (dest) {
+                b->rx_out[count_out] = rx;
+                b->dirs_out[count_out] = dir;
+                b->addrs_out[count_out] = *dest;
+                b->iovs_out[count_out].iov_base = p;
+                b->iovs_out[count_out].iov_len = n;
+                udp_set_gso_size(&b->msgs_out[count_out].msg_hdr, b->ctrls_out + count_out * UDP_CTRL_SIZE, s, n);
+                ++count_out;
             }
+        }
+        conn_unlock();
+        pending_send(w->sockfd);
+        send_with_latency(w->sockfd, b->msgs_out, b->rx_out, b->dirs_out, count_out);
+    } while (offs < len);
+}
+
+/**
+ * send the datagrams a connected flow has collected in the outgoing
+ * messages of the batch on its socket of the other side
+ */
+static void send_connected(worker_t* w, int sockfd, unsigned count_out) {
+    batch_t* b = &w->batch;
+    for (unsigned i = 0; i < count_out; ++i) {
+        b->msgs_out[i].msg_hdr.msg_name = NULL;
+        b->msgs_out[i].msg_hdr.msg_namelen = 0;
+    }
+    send_with_latency(sockfd, b->msgs_out, b->rx_out, b->dirs_out, count_out);
+    for (unsigned i = 0; i < count_out; ++i) {
+        b->msgs_out[i].msg_hdr.msg_name = &b->addrs_out[i];
+        b->msgs_out[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+}
 
-            // Test whether this originates from the inside agent. All possible inside agent
-            // tunnel addresses must be present in our connection table.
-            conn_entry_t* conn = conn_table_find_tunnel_address(&addr_incoming);
-            if (conn) {
-                sendto(sockfd, buffer, nbytes, 0, (struct sockaddr*)&conn->addr_client, len_addr);
-                continue;
+/**
+ * forward what has arrived on one of the connected sockets of a flow to
+ * the other one. The entry is known from the socket, so there is nothing
+ * to look up and the datagrams go out with plain sends on the socket of
+ * the other side. Keepalives still need to be verified, they and anything
+ * that arrived before the socket was connected take the regular way.
+ */
+static void serve_flow(worker_t* w, conn_entry_t* e, conn_sock_kind_t kind) {
+    batch_t* b = &w->batch;
+    bool from_tunnel = (kind == CONN_SOCK_TUNNEL);
+    struct sockaddr_in* peer = from_tunnel ? &e->addr_tunnel : &e->addr_client;
+    metric_dir_t dir = from_tunnel ? METRIC_DOWN : METRIC_UP;
+
+    int sock_out = from_tunnel ? e->sock_service : e->sock_tunnel;
+    int count_in = batch_recv(b, from_tunnel ? e->sock_tunnel : e->sock_service);
+    if (count_in <= 0) {
+        return;
+    }
+    uint64_t woke = realtime_nanosec();
+    unsigned count_out = 0;
+    unsigned packets = 0;
+    size_t bytes = 0;
+
+    conn_lock();
+    for (int i = 0; i < count_in; ++i) {
+        char* data = b->iovs_in[i].iov_base;
+        size_t len = b->msgs_in[i].msg_len;
+        uint16_t seg = settings->gso ? udp_gro_size(&b->msgs_in[i].msg_hdr) : 0;
+        uint64_t rx = udp_rx_time(&b->msgs_in[i].msg_hdr);
+        if (rx == 0) {
+            rx = woke;
+        }
+        if ((b->addrs_in[i].sin_addr.s_addr != peer->sin_addr.s_addr) || (b->addrs_in[i].sin_port != peer->sin_port)
+                || (from_tunnel && ((len == sizeof(mac_t)) || (seg == sizeof(mac_t))))) {
+            // the entry belongs to us, it stays while the lock is released
+            conn_unlock();
+            send_connected(w, sock_out, count_out);
+            count_out = 0;
+            route_and_send(w, &b->addrs_in[i], data, len, seg, rx);
+            conn_lock();
+            continue;
+        }
+        b->rx_out[count_out] = rx;
+        b->dirs_out[count_out] = dir;
+        b->iovs_out[count_out].iov_base = data;
+        b->iovs_out[count_out].iov_len = len;
+        udp_set_gso_size(&b->msgs_out[count_out].msg_hdr, b->ctrls_out + count_out * UDP_CTRL_SIZE, seg, len);
+        packets += METRIC_SEGMENTS(len, seg);
+        bytes += len;
+        ++count_out;
+    }
+    if (from_tunnel) {
+        METRIC_FORWARD(e, down, packets, bytes);
+    } else {
+        METRIC_FORWARD(e, up, packets, bytes);
+    }
+    conn_unlock();
+
+    // the entry belongs to us, nobody else closes its sockets
+    send_connected(w, sock_out, count_out);
+    ++w->stat_calls;
+    w->stat_datagrams += count_in;
+}
+
+/**
+ * sleep until one of the sockets of the worker is readable or the next
+ * timer is due and serve the connected sockets that are. The listening
+ * socket is read by the caller, it goes through the same epoll set so
+ * that a busy listening socket can't starve the connected ones.
+ *
+ * @return true if the listening socket is readable
+ */
+static bool wait_flows(worker_t* w) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    bool listening = false;
+    int count = epoll_wait(w->epfd, events, EPOLL_MAX_EVENTS, sleep_time(w));
+    clock_update();
+    for (int i = 0; i < count; ++i) {
+        conn_sock_kind_t kind;
+        conn_entry_t* e = conn_from_event(&events[i], &kind);
+        if (e) {
+            serve_flow(w, e, kind);
+        } else {
+            listening = true;
+        }
+    }
+    return listening;
+}
+
+/**
+ * the receive and forward loop of one worker. All workers share the same
+ * connection table, the lock is only held while a received batch is being
+ * classified, system calls happen outside of it. Worker 0 is also
+ * responsible for the expiry timers of the table, unless flows have their
+ * own connected sockets.
+ */
+static void* run_worker(void* arg) {
+    worker_t* w = arg;
+    int sockfd = w->sockfd;
+    unsigned batch = w->args->batch;
+    bool gso = w->args->gso;
+    batch_t* b = &w->batch;
+
+    if (w->args->cpu_count) {
+        pin_to_cpu(w->args->cpus[w->id % w->args->cpu_count]);
+    }
+    clock_update();
+    metrics_register();
+
+    // with connected sockets a worker waits for its listening socket and the
+    // connected sockets it has adopted together, the listening socket is the NULL entry
+    w->epfd = -1;
+    if (w->args->connected) {
+        wheel_init(&w->own_wheel, clock_now());
+        w->wheel = &w->own_wheel;
+        w->epfd = epoll_create1(0);
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.u64 = 0
+        };
+        if ((w->epfd < 0) || (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)) {
+            print_e(LOG_ERROR, "could not create epoll instance");
+            exit(EXIT_FAILURE);
+        }
+    }
+    conn_table_set_worker(w->epfd, w->wheel);
+
+    batch_init(b, batch);
+    mac_t* macs = calloc(batch, sizeof(mac_t));
+    unsigned* macs_idx = calloc(batch, sizeof(unsigned));
+    bool* macs_ok = calloc(batch, sizeof(bool));
+    bool* macs_valid = calloc(batch, sizeof(bool));
+    bool* macs_known = calloc(batch, sizeof(bool));
+    if (!macs || !macs_idx || !macs_ok || !macs_valid || !macs_known) {
+        print_e(LOG_ERROR, "could not allocate buffers for %u datagrams", batch);
+        exit(EXIT_FAILURE);
+    }
+
+    while ("my guitar gently weeps") {
+        int count_in = 0;
+        if (w->epfd >= 0) {
+            // the connected sockets get their turn on every pass, the listening socket
+            // only one batch per pass like each of them
+            if (wait_flows(w)) {
+                count_in = batch_recv(b, sockfd);
             }
+        } else {
+            // take whatever is already queued, only if there is nothing sleep until there is
+            // data or the next timer is due. Under load this is one system call per batch.
+            count_in = batch_recv(b, sockfd);
+            if ((count_in < 0) && (errno == EAGAIN)) {
+                struct pollfd pfd = {
+                    .fd = sockfd,
+                    .events = POLLIN
+                };
+                poll(&pfd, 1, sleep_time(w));
+            }
+        }
+        clock_update();
+        if (count_in > 0) {
+            // datagrams without a kernel timestamp count as arrived when we woke up
+            uint64_t woke = realtime_nanosec();
 
-            // This is not from one of the known tunnel addresses, so it must be from a client.
-            conn = conn_table_find_client_address(&addr_incoming);
-            if (conn == NULL) {
-                if (log_client_connections) {
-                    print(LOG_INFO, "new client conection from %s:%d", inet_ntoa(addr_incoming.sin_addr), addr_incoming.sin_port);
+            // verify all keepalive sized datagrams of the batch that pass the cheap
+            // checks in one multi-buffer call, without holding the lock. It is only
+            // taken briefly to see which of them come from known tunnels, those skip
+            // the rate limit. The replay window is lock free, so the nonces get
+            // accepted here too.
+            unsigned count_macs = 0;
+            for (int i = 0; i < count_in; ++i) {
+                if (b->msgs_in[i].msg_len == sizeof(mac_t)) {
+                    macs_valid[i] = false;
+                    macs_idx[count_macs++] = i;
+                }
+            }
+            if (count_macs) {
+                conn_lock();
+                for (unsigned k = 0; k < count_macs; ++k) {
+                    macs_known[k] = (conn_table_find_tunnel_address(&b->addrs_in[macs_idx[k]]) != NULL);
+                }
+                conn_unlock();
+            }
+            unsigned count_check = 0;
+            for (unsigned k = 0; k < count_macs; ++k) {
+                unsigned i = macs_idx[k];
+                memcpy(&macs[count_check], b->iovs_in[i].iov_base, sizeof(mac_t));
+                if (preauth_check(&b->addrs_in[i], macs[count_check].nonce, macs_known[k])) {
+                    macs_idx[count_check++] = i;
                 }
+            }
+            count_macs = count_check;
+            mac_check_keepalives(macs, count_macs, macs_ok);
+            for (unsigned k = 0; k < count_macs; ++k) {
+                macs_valid[macs_idx[k]] = macs_ok[k] && mac_accept(macs[k].nonce);
+                preauth_result(macs_valid[macs_idx[k]]);
+            }
 
-                // now try to find a spare tunnel for this new client and activate it
-                conn = conn_table_find_next_spare();
-                if (conn) {
-                    conn->spare = false;
-                    memcpy(&conn->addr_client, &addr_incoming, len_addr);
+            unsigned count_out = 0;
+            conn_lock();
+            for (int i = 0; i < count_in; ++i) {
+                char* data = b->iovs_in[i].iov_base;
+                size_t len = b->msgs_in[i].msg_len;
+                uint16_t seg = gso ? udp_gro_size(&b->msgs_in[i].msg_hdr) : 0;
+                uint64_t rx = udp_rx_time(&b->msgs_in[i].msg_hdr);
+                if (rx == 0) {
+                    rx = woke;
+                }
+                metric_dir_t dir;
+                if ((seg == sizeof(mac_t)) && (len > seg)) {
+                    // a train of keepalive sized datagrams, every one of them could be a keepalive,
+                    // so take it apart, after everything before it has been sent to keep the order.
+                    conn_unlock();
+                    pending_send(sockfd);
+                    send_with_latency(sockfd, b->msgs_out, b->rx_out, b->dirs_out, count_out);
+                    count_out = 0;
+                    route_and_send(w, &b->addrs_in[i], data, len, seg, rx);
+                    conn_lock();
+                    continue;
+                }
+                struct sockaddr_in* dest = route(&b->addrs_in[i], &data, &len, seg, &macs_valid[i], &dir);
+                if (dest) {
+                    b->rx_out[count_out] = rx;
+                    b->dirs_out[count_out] = dir;
+                    b->addrs_out[count_out] = *dest;
+                    b->iovs_out[count_out].iov_base = data;
+                    b->iovs_out[count_out].iov_len = len;
+                    udp_set_gso_size(&b->msgs_out[count_out].msg_hdr, b->ctrls_out + count_out * UDP_CTRL_SIZE, seg, len);
+                    ++count_out;
                 }
             }
+            conn_unlock();
+            // held datagrams of a client whose tunnel came up in this batch go first
+            pending_send(sockfd);
+            send_with_latency(sockfd, b->msgs_out, b->rx_out, b->dirs_out, count_out);
+            ++w->stat_calls;
+            w->stat_datagrams += count_in;
+        }
+
+        housekeeping(w, batch);
+    }
+    return NULL;
+}
+
+#ifdef HAVE_URING
+/**
+ * send slots are indexed by the id of the buffer holding the datagram,
+ * a buffer can only ever be used by one send at a time.
+ */
+typedef struct {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_in addr;
+} send_slot_t;
+
+#define UD_RECV     0
+#define UD_SEND     (1ULL << 32)
+
+static void arm_recv(uring_t* ring, uring_bufs_t* bufs, int sockfd, struct msghdr* msg) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sockfd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufs->bgid;
+    sqe->user_data = UD_RECV;
+}
+
+/**
+ * the same loop as run_worker() but on top of io_uring. One multishot
+ * receive keeps delivering datagrams into buffers from a provided buffer
+ * ring, forwards are queued as sends straight from these buffers, and a
+ * buffer goes back to the ring once its send has completed. The sends
+ * queued in one pass are linked, so the datagrams leave in the order they
+ * arrived even when one of them has to wait for room in the socket.
+ * Submitting all queued sends and waiting for the next completions is a
+ * single system call per wakeup, no matter how many datagrams it covers.
+ * With --sqpoll a kernel thread picks up the sends and we only enter the
+ * kernel when there are no completions to process, so under load the
+ * loop runs without any system calls.
+ */
+static void* run_worker_uring(void* arg) {
+    worker_t* w = arg;
+    uring_t ring;
+    uring_bufs_t bufs;
+    struct msghdr msg_recv = {0};
+    send_slot_t* slots = calloc(URING_BUFS, sizeof(send_slot_t));
+
+    if (w->args->cpu_count) {
+        pin_to_cpu(w->args->cpus[w->id % w->args->cpu_count]);
+    }
+    clock_update();
+    conn_table_set_worker(-1, &wheel);
+    metrics_register();
+
+    if (!uring_init(&ring, 2 * URING_BUFS, w->args->sqpoll ? URING_SQPOLL_IDLE_MS : 0) || !uring_bufs_init(&ring, &bufs, 0, URING_BUFS, URING_BUF_SIZE)) {
+        print_e(LOG_ERROR, "could not set up io_uring");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < URING_BUFS; ++i) {
+        slots[i].msg.msg_name = &slots[i].addr;
+        slots[i].msg.msg_namelen = sizeof(struct sockaddr_in);
+        slots[i].msg.msg_iov = &slots[i].iov;
+        slots[i].msg.msg_iovlen = 1;
+    }
+
+    // the kernel puts an io_uring_recvmsg_out header and the source address in front of each payload
+    msg_recv.msg_namelen = sizeof(struct sockaddr_in);
+    arm_recv(&ring, &bufs, w->sockfd, &msg_recv);
+
+    while ("my guitar gently weeps") {
+        bool ready = (uring_peek_cqe(&ring) != NULL);
+        if (uring_submit_and_wait(&ring, ready ? 0 : 1, sleep_time(w)) < 0 && errno != ETIME && errno != EINTR) {
+            print_e(LOG_ERROR, "io_uring_enter returned error");
+            exit(EXIT_FAILURE);
+        }
+        clock_update();
+        // there are no kernel timestamps on this path, the datagrams count as arrived when we woke up
+        uint64_t woke = realtime_nanosec();
 
-            // if we have a tunnel conection for this client then we can forward it to the inside
-            if (conn) {
-                sendto(sockfd, buffer, nbytes, 0, (struct sockaddr*)&conn->addr_tunnel, len_addr);
+        bool rearm = false;
+        unsigned count_in = 0;
+        unsigned count_out[2] = {0, 0};
+        struct io_uring_cqe* cqe;
+        struct io_uring_sqe* last_send = NULL;
+        conn_lock();
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            if (cqe->user_data & UD_SEND) {
+                if (cqe->res < 0) {
+                    METRIC_INC(drop_send_error);
+                }
+                uring_bufs_put(&bufs, cqe->user_data & 0xffff);
             } else {
-                if (log_client_connections) {
-                    print(LOG_WARN, "could not find tunnel connection for client, dropping package");
-                    print(LOG_DEBUG, "will not repeat above warning until inside agent connects again");
-                    log_client_connections = false;
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    rearm = true;
+                }
+                if ((cqe->res >= 0) && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    char* buf = uring_bufs_get(&bufs, bid);
+                    struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buf;
+                    struct sockaddr_in* src = (struct sockaddr_in*)(buf + sizeof(*out));
+                    char* payload = buf + sizeof(*out) + msg_recv.msg_namelen + msg_recv.msg_controllen;
+                    size_t len = out->payloadlen;
+                    struct sockaddr_in* dest = NULL;
+                    metric_dir_t dir;
+                    if (!(out->flags & MSG_TRUNC)) {
+                        dest = route(src, &payload, &len, 0, NULL, &dir);
+                    }
+                    if (dest) {
+                        send_slot_t* slot = &slots[bid];
+                        slot->addr = *dest;
+                        slot->iov.iov_base = payload;
+                        slot->iov.iov_len = len;
+                        struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+                        sqe->opcode = IORING_OP_SENDMSG;
+                        sqe->fd = w->sockfd;
+                        sqe->addr = (uintptr_t)&slot->msg;
+                        sqe->len = 1;
+                        sqe->user_data = UD_SEND | bid;
+                        if (last_send) {
+                            uring_link(&ring, last_send);
+                        }
+                        last_send = sqe;
+                        ++count_out[dir];
+                    } else {
+                        uring_bufs_put(&bufs, bid);
+                    }
+                    ++count_in;
+                }
+            }
+            uring_cqe_seen(&ring);
+        }
+        conn_unlock();
+        pending_send(w->sockfd);
+        if (count_out[METRIC_UP] || count_out[METRIC_DOWN]) {
+            // the sends are handed to the kernel with the next submit, right after this
+            uint64_t tx = realtime_nanosec();
+            for (metric_dir_t dir = METRIC_UP; dir <= METRIC_DOWN; ++dir) {
+                for (unsigned i = 0; i < count_out[dir]; ++i) {
+                    METRIC_LATENCY(dir, woke, tx);
                 }
             }
         }
+        if (rearm) {
+            arm_recv(&ring, &bufs, w->sockfd, &msg_recv);
+        }
+        if (count_in) {
+            ++w->stat_calls;
+            w->stat_datagrams += count_in;
+        }
+
+        housekeeping(w, URING_BUFS);
+    }
+    return NULL;
+}
+#endif
+
+void run_outside(args_parsed_t args) {
+    worker_t* workers = calloc(args.threads, sizeof(worker_t));
+
+    print(LOG_INFO, "UDP tunnel outside agent v" VERSION_STR);
+
+    wheel_init(&wheel, clock_update());
+    conn_table_set_lifetime(args.keepalive + 10, true);
+    if (args.max_conns) {
+        conn_table_set_capacity(args.max_conns);
+    }
+
+    // flow IDs start somewhere else after every restart, so that flows the inside
+    // agent still remembers from before are not mixed up with new clients
+    pending_init(args.mux ? 0 : args.queue);
+    mux = (args.mux > 0);
+    next_flow = (uint32_t)realtime_millisec();
+    if (mux) {
+        print(LOG_INFO, "multiplexing all clients over the tunnels");
+    }
+
+    // the sockets must be bound in worker order, the steering program
+    // returns the index of the socket within the reuseport group
+    settings = &args;
+    for (unsigned i = 0; i < args.threads; ++i) {
+        workers[i].id = i;
+        workers[i].args = &args;
+        workers[i].wheel = &wheel;
+        workers[i].sockfd = create_socket(&args);
+    }
+    if (args.steer && (args.threads > 1)) {
+        attach_steering(workers[0].sockfd, args.threads);
+    }
+    if (args.xdp) {
+        if (!xdp_attach(args.xdp, args.listenport, 2 * (args.max_conns ? args.max_conns : XDP_MAX_FLOWS), args.xdp_generic)) {
+            print_e(LOG_ERROR, "could not attach XDP program to %s", args.xdp);
+            exit(EXIT_FAILURE);
+        }
+        conn_table_set_remove_callback(fast_path_remove);
+        fast_path = true;
+        print(LOG_INFO, "forwarding established clients with XDP on %s", args.xdp);
+    }
+
+    void* (*worker_loop)(void*) = run_worker;
+#ifdef HAVE_URING
+    if (args.uring) {
+        worker_loop = run_worker_uring;
+        print(LOG_INFO, "using io_uring");
+    }
+#endif
+
+    print(LOG_INFO, "listening on port %d with %u worker(s)", args.listenport, args.threads);
+    print(LOG_DEBUG, "using %s SHA-256", sha_256_impl_name());
+    metrics_watch_signal();
+    if (args.metrics) {
+        metrics_serve(args.metrics);
+    }
 
-        uint64_t ms = millisec();
-        if (ms - time_last_cleanup > 1000) {
-            time_last_cleanup = ms;
-            conn_table_clean(args.keepalive + 10, true); // periodic cleaning of stale entries
+    for (unsigned i = 1; i < args.threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+            print_e(LOG_ERROR, "could not start worker thread %u", i);
+            exit(EXIT_FAILURE);
         }
     }
+    worker_loop(&workers[0]);
 }
@@ -18,9 +18,7 @@
  */
 int main(int argc, char *args[]) {
     args_parsed_t parsed = args_parse(argc, args);
-    if (parsed.secret) {
-        mac_init(parsed.secret, strlen(parsed.secret));
-    }
+    mac_init(parsed.secret, parsed.secret ? strlen(parsed.secret) : 0);
     if (parsed.listenport) {
         run_outside(parsed);
     } else {
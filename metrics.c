@@ -0,0 +1,339 @@
+#include "metrics.h"
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "connlist.h"
+#include "misc.h"
+
+/**
+ * Every thread counts into its own metrics_t, registered once in a global
+ * list. The forwarding path never takes a lock or makes a system call for
+ * counting, all the work of adding things up is done by the thread serving
+ * a scrape. Counters of threads that did not register (the main thread
+ * before it becomes a worker) end up in a shared fallback block.
+ */
+static metrics_t unregistered = {0};
+static metrics_t* all = &unregistered;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread metrics_t* metrics = &unregistered;
+
+/**
+ * give the calling thread its own block of counters
+ */
+void metrics_register(void) {
+    metrics_t* m = calloc(1, sizeof(metrics_t));
+    if (m == NULL) {
+        print_e(LOG_ERROR, "could not allocate metrics");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&list_lock);
+    m->next = all;
+    all = m;
+    pthread_mutex_unlock(&list_lock);
+    metrics = m;
+}
+
+/**
+ * add up the counters of all threads
+ *
+ * @param total will receive the sums, its next pointer is meaningless
+ */
+void metrics_sum(metrics_t* total) {
+    memset(total, 0, sizeof(metrics_t));
+    pthread_mutex_lock(&list_lock);
+    for (metrics_t* m = all; m != NULL; m = m->next) {
+        uint64_t* src = (uint64_t*)m;
+        uint64_t* dst = (uint64_t*)total;
+        for (size_t i = 0; i < offsetof(metrics_t, next) / sizeof(uint64_t); ++i) {
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&list_lock);
+}
+
+static void write_header(FILE* f, const char* name, const char* type, const char* help) {
+    fprintf(f, "# HELP udp_tunnel_%s %s\n# TYPE udp_tunnel_%s %s\n", name, help, name, type);
+}
+
+/**
+ * lowest value counted in a latency bucket, the bucket ends where the
+ * next one starts
+ */
+static uint64_t bucket_low(unsigned i) {
+    if (i < 2 * LATENCY_SUB) {
+        return i;
+    }
+    unsigned msb = i / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    return (uint64_t)(LATENCY_SUB + i % LATENCY_SUB) << (msb - LATENCY_SUB_BITS);
+}
+
+/**
+ * write the latency histograms. Prometheus wants a fixed set of bucket
+ * boundaries, the powers of two from about 1us to 8s are exact boundaries
+ * of our buckets, so each of them covers a range of whole buckets.
+ */
+static void write_latency(FILE* f, metrics_t* m) {
+    static const char* dirs[] = {"up", "down"};
+    write_header(f, "forward_latency_seconds", "histogram", "Time from the arrival of a datagram to sending it on.");
+    for (int d = 0; d < 2; ++d) {
+        uint64_t count = 0;
+        unsigned i = 0;
+        for (unsigned k = 10; k <= 33; ++k) {
+            for (; i < metrics_latency_bucket(1ULL << k); ++i) {
+                count += m->latency[d][i];
+            }
+            fprintf(f, "udp_tunnel_forward_latency_seconds_bucket{direction=\"%s\",le=\"%.9g\"} %lu\n",
+                dirs[d], (double)(1ULL << k) / 1e9, count);
+        }
+        for (; i < LATENCY_BUCKETS; ++i) {
+            count += m->latency[d][i];
+        }
+        fprintf(f, "udp_tunnel_forward_latency_seconds_bucket{direction=\"%s\",le=\"+Inf\"} %lu\n", dirs[d], count);
+        fprintf(f, "udp_tunnel_forward_latency_seconds_sum{direction=\"%s\"} %.9f\n", dirs[d], m->latency_sum[d] / 1e9);
+        fprintf(f, "udp_tunnel_forward_latency_seconds_count{direction=\"%s\"} %lu\n", dirs[d], count);
+    }
+}
+
+/**
+ * log count, average and some percentiles of the latency histograms.
+ * A percentile is reported as the upper end of the bucket it falls into.
+ */
+static void print_latency(metrics_t* m) {
+    static const char* dirs[] = {"up", "down"};
+    static const double ranks[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    for (int d = 0; d < 2; ++d) {
+        uint64_t count = 0;
+        for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+            count += m->latency[d][i];
+        }
+        if (count == 0) {
+            print(LOG_INFO, "forwarding latency %s: no datagrams", dirs[d]);
+            continue;
+        }
+        double us[5];
+        uint64_t seen = 0;
+        unsigned i = 0;
+        for (int r = 0; r < 5; ++r) {
+            uint64_t rank = (uint64_t)(ranks[r] * count);
+            if (rank < 1) {
+                rank = 1;
+            }
+            while (seen + m->latency[d][i] < rank) {
+                seen += m->latency[d][i++];
+            }
+            us[r] = bucket_low(i + 1) / 1e3;
+        }
+        print(LOG_INFO, "forwarding latency %s: %lu datagrams, avg %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+            dirs[d], count, m->latency_sum[d] / 1e3 / count, us[0], us[1], us[2], us[3], us[4]);
+    }
+}
+
+static void write_conn(FILE* f, conn_entry_t* e, conn_extra_t* x, const char* name, const char* dir, uint64_t value) {
+    fprintf(f, "udp_tunnel_conn_%s{conn=\"%u\"", name, e->idx);
+    if (e->addr_client.sin_port) {
+        fprintf(f, ",client=\"%s:%d\"", inet_ntoa(e->addr_client.sin_addr), ntohs(e->addr_client.sin_port));
+    }
+    if (e->addr_tunnel.sin_port) {
+        fprintf(f, ",tunnel=\"%s:%d\"", inet_ntoa(e->addr_tunnel.sin_addr), ntohs(e->addr_tunnel.sin_port));
+    }
+    if (x->flow || (x->mux != CONN_NONE)) {
+        fprintf(f, ",flow=\"%08x\"", x->flow);
+    }
+    fprintf(f, ",direction=\"%s\"} %lu\n", dir, value);
+}
+
+/**
+ * write all metrics in the Prometheus text exposition format. The table
+ * lock is only held while copying the entries.
+ */
+static void write_metrics(FILE* f) {
+    metrics_t m;
+    metrics_sum(&m);
+
+    conn_lock();
+    unsigned total = conn_count();
+    unsigned spare = conn_spare_count();
+    unsigned sockets = conn_socket_count();
+    conn_entry_t* entries = malloc((total + 1) * sizeof(conn_entry_t));
+    conn_extra_t* extras = malloc((total + 1) * sizeof(conn_extra_t));
+    unsigned n = (entries && extras) ? conn_table_snapshot(entries, extras, total) : 0;
+    conn_unlock();
+
+    write_header(f, "packets_total", "counter", "Datagrams forwarded, up is from the clients towards the service.");
+    fprintf(f, "udp_tunnel_packets_total{direction=\"up\"} %lu\n", m.packets_up);
+    fprintf(f, "udp_tunnel_packets_total{direction=\"down\"} %lu\n", m.packets_down);
+    write_header(f, "bytes_total", "counter", "Payload bytes forwarded.");
+    fprintf(f, "udp_tunnel_bytes_total{direction=\"up\"} %lu\n", m.bytes_up);
+    fprintf(f, "udp_tunnel_bytes_total{direction=\"down\"} %lu\n", m.bytes_down);
+    write_header(f, "drops_total", "counter", "Datagrams dropped.");
+    fprintf(f, "udp_tunnel_drops_total{reason=\"no_spare\"} %lu\n", m.drop_no_tunnel);
+    fprintf(f, "udp_tunnel_drops_total{reason=\"table_full\"} %lu\n", m.drop_table_full);
+    fprintf(f, "udp_tunnel_drops_total{reason=\"send_error\"} %lu\n", m.drop_send_error);
+    write_header(f, "keepalives_sent_total", "counter", "Keepalives sent by the inside agent.");
+    fprintf(f, "udp_tunnel_keepalives_sent_total %lu\n", m.keepalive_sent);
+    write_header(f, "keepalives_received_total", "counter", "Keepalives accepted by the outside agent.");
+    fprintf(f, "udp_tunnel_keepalives_received_total %lu\n", m.keepalive_received);
+    write_header(f, "keepalives_rejected_total", "counter", "Keepalive sized datagrams that failed verification.");
+    fprintf(f, "udp_tunnel_keepalives_rejected_total{reason=\"mac\"} %lu\n", m.keepalive_mac);
+    fprintf(f, "udp_tunnel_keepalives_rejected_total{reason=\"nonce\"} %lu\n", m.keepalive_nonce);
+    fprintf(f, "udp_tunnel_keepalives_rejected_total{reason=\"rate_limit\"} %lu\n", m.keepalive_rate);
+    write_latency(f, &m);
+    write_header(f, "connections", "gauge", "Entries in the connection table.");
+    fprintf(f, "udp_tunnel_connections{state=\"active\"} %u\n", total - spare);
+    fprintf(f, "udp_tunnel_connections{state=\"spare\"} %u\n", spare);
+    write_header(f, "sockets", "gauge", "Sockets owned by the connection table.");
+    fprintf(f, "udp_tunnel_sockets %u\n", sockets);
+
+    write_header(f, "conn_packets_total", "counter", "Datagrams forwarded per connection.");
+    for (unsigned i = 0; i < n; ++i) {
+        write_conn(f, &entries[i], &extras[i], "packets_total", "up", extras[i].packets_up);
+        write_conn(f, &entries[i], &extras[i], "packets_total", "down", extras[i].packets_down);
+    }
+    write_header(f, "conn_bytes_total", "counter", "Payload bytes forwarded per connection.");
+    for (unsigned i = 0; i < n; ++i) {
+        write_conn(f, &entries[i], &extras[i], "bytes_total", "up", extras[i].bytes_up);
+        write_conn(f, &entries[i], &extras[i], "bytes_total", "down", extras[i].bytes_down);
+    }
+    free(entries);
+    free(extras);
+}
+
+/**
+ * answer one scrape. Prometheus speaks HTTP, so if the request looks like
+ * one the answer gets a minimal HTTP header. Anything else (socat, nc)
+ * that sends nothing within a short time gets the plain text.
+ */
+static void serve_client(int fd) {
+    char req[1024];
+    ssize_t len = 0;
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN
+    };
+    if (poll(&pfd, 1, 200) > 0) {
+        len = recv(fd, req, sizeof(req) - 1, 0);
+    }
+    bool http = (len >= 4) && (memcmp(req, "GET ", 4) == 0);
+
+    char* body = NULL;
+    size_t body_len = 0;
+    FILE* f = open_memstream(&body, &body_len);
+    if (f == NULL) {
+        return;
+    }
+    write_metrics(f);
+    fclose(f);
+
+    char head[128];
+    int head_len = 0;
+    if (http) {
+        head_len = snprintf(head, sizeof(head),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+    }
+    if ((send(fd, head, head_len, MSG_NOSIGNAL) == head_len)) {
+        for (size_t sent = 0; sent < body_len;) {
+            ssize_t n = send(fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+    }
+    free(body);
+}
+
+static void* run_server(void* arg) {
+    int sockfd = (intptr_t)arg;
+    struct timeval timeout = {
+        .tv_sec = 1
+    };
+    while ("my guitar gently weeps") {
+        int fd = accept(sockfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_client(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * start a thread that serves the metrics on a Unix domain socket. A stale
+ * socket file left over from an earlier run is replaced.
+ *
+ * @param path file system path of the socket
+ */
+void metrics_serve(const char* path) {
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX
+    };
+    pthread_t thread;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        print(LOG_ERROR, "metrics socket path '%s' is too long", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        print_e(LOG_ERROR, "could not create metrics socket");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    if ((bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(sockfd, 8) < 0)) {
+        print_e(LOG_ERROR, "could not listen on metrics socket '%s'", path);
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&thread, NULL, run_server, (void*)(intptr_t)sockfd) != 0) {
+        print_e(LOG_ERROR, "could not start metrics thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    print(LOG_INFO, "serving metrics on %s", path);
+}
+
+static void* run_signal(void* arg) {
+    sigset_t* set = arg;
+    int sig;
+    while ("my guitar gently weeps") {
+        if (sigwait(set, &sig) == 0) {
+            metrics_t m;
+            metrics_sum(&m);
+            print_latency(&m);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * log the latency histograms whenever the process receives SIGUSR1. The
+ * signal is blocked and waited for by a thread of its own, so this must
+ * be called before any other thread is started, they inherit the mask.
+ */
+void metrics_watch_signal(void) {
+    static sigset_t set;
+    pthread_t thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (pthread_create(&thread, NULL, run_signal, &set) != 0) {
+        print_e(LOG_ERROR, "could not start signal thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,96 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/**
+ * Forwarding latencies are counted in log-linear buckets like in an HDR
+ * histogram: values below 2 * LATENCY_SUB each have their own bucket,
+ * above that every power of two is split into LATENCY_SUB buckets, which
+ * keeps the relative error below 1 / LATENCY_SUB over the whole range. The
+ * values are nanoseconds, everything above 2^LATENCY_MAX_BITS (about a
+ * minute) ends up in the last bucket.
+ */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+typedef enum {
+    METRIC_UP = 0,      // from the clients towards the service
+    METRIC_DOWN = 1
+} metric_dir_t;
+
+/**
+ * counters of one thread. Only the owning thread ever writes them, so an
+ * increment is a plain load and store without a lock prefix, the relaxed
+ * atomic store only makes sure a concurrent scrape never sees a torn value.
+ * "up" is the direction from the clients towards the service.
+ */
+typedef struct metrics metrics_t;
+struct metrics {
+    uint64_t packets_up;
+    uint64_t bytes_up;
+    uint64_t packets_down;
+    uint64_t bytes_down;
+    uint64_t drop_no_tunnel;        // no spare tunnel for a new client and no room to hold its datagrams
+    uint64_t drop_table_full;       // a new connection was refused because of --max-conns
+    uint64_t drop_send_error;       // sending a datagram failed
+    uint64_t keepalive_sent;
+    uint64_t keepalive_received;
+    uint64_t keepalive_nonce;       // keepalive sized datagrams rejected by nonce
+    uint64_t keepalive_rate;        // ... by the rate limit of their source
+    uint64_t keepalive_mac;         // ... by their authentication code
+    uint64_t latency_sum[2];        // per direction, nanoseconds from arrival to sending
+    uint64_t latency[2][LATENCY_BUCKETS];
+    metrics_t* next;
+};
+
+extern __thread metrics_t* metrics;
+
+#define METRIC_STORE_ADD(var, n) __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+#define METRIC_ADD(field, n) METRIC_STORE_ADD(metrics->field, n)
+#define METRIC_INC(field) METRIC_ADD(field, 1)
+
+// number of datagrams in a train of len bytes with segment size seg (0 for a single datagram)
+#define METRIC_SEGMENTS(len, seg) ((seg) ? ((len) + (seg) - 1) / (seg) : 1)
+
+static inline unsigned metrics_latency_bucket(uint64_t ns) {
+    if (ns < 2 * LATENCY_SUB) {
+        return ns;
+    }
+    unsigned msb = 63 - __builtin_clzll(ns);
+    if (msb >= LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB + ((ns >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+/**
+ * count the time a datagram spent in the agent, from its arrival (rx) to
+ * the moment it is handed to the kernel for sending (tx)
+ */
+#define METRIC_LATENCY(dir, rx, tx) do { \
+        uint64_t ns_ = ((tx) > (rx)) ? (tx) - (rx) : 0; \
+        METRIC_ADD(latency_sum[dir], ns_); \
+        METRIC_ADD(latency[dir][metrics_latency_bucket(ns_)], 1); \
+    } while (0)
+
+/**
+ * count a forwarded datagram (or a train of them) in the counters of the
+ * calling thread and of its connection entry
+ */
+#define METRIC_FORWARD(e, dir, n, len) do { \
+        METRIC_ADD(packets_##dir, n); \
+        METRIC_ADD(bytes_##dir, len); \
+        conn_extra_t* x_ = conn_extra(e); \
+        METRIC_STORE_ADD(x_->packets_##dir, n); \
+        METRIC_STORE_ADD(x_->bytes_##dir, len); \
+    } while (0)
+
+void metrics_register(void);
+void metrics_sum(metrics_t* total);
+void metrics_serve(const char* path);
+void metrics_watch_signal(void);
+
+#endif // METRICS_H
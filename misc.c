@@ -1,51 +1,280 @@
+#define _GNU_SOURCE
 #include "misc.h"
 
+#include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static __thread uint64_t clock_cached = 0;
 
 /**
  * return timestamp in milliseconds
  * 
- * @return current system time in milliseconds
+ * @return monotonic time in milliseconds
  */
 uint64_t millisec() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
+}
+
+/**
+ * return wall clock timestamp in milliseconds. Unlike millisec() this keeps
+ * increasing across reboots, which is needed for the keepalive nonces.
+ *
+ * @return current system time in milliseconds
+ */
+uint64_t realtime_millisec() {
     struct timespec spec;
     clock_gettime(CLOCK_REALTIME, &spec);
     return spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
 }
 
 /**
- * print to stdout, prefix with <level> for prety systemd log level coloring
- * 
- * @param level log levek
- * @param fmt format string for printf
- * @param ... args for printf
+ * return wall clock timestamp in nanoseconds, on the same clock as the
+ * receive timestamps of the kernel (SO_TIMESTAMPNS)
+ *
+ * @return current system time in nanoseconds
  */
-void print(log_level_t level, char* fmt, ...) {
-    printf("<%d>", level);
-    va_list arglist;
-    va_start(arglist, fmt);
-    vprintf(fmt, arglist);
-    va_end(arglist);
-    puts("");
+uint64_t realtime_nanosec() {
+    struct timespec spec;
+    clock_gettime(CLOCK_REALTIME, &spec);
+    return spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+/**
+ * read the monotonic clock and remember it for the calling thread. The
+ * event loops call this once per wakeup, everything else uses clock_now().
+ *
+ * @return monotonic time in milliseconds
+ */
+uint64_t clock_update() {
+    clock_cached = millisec();
+    return clock_cached;
+}
+
+/**
+ * return the time of the last clock_update() in the calling thread
+ *
+ * @return monotonic time in milliseconds
+ */
+uint64_t clock_now() {
+    return clock_cached;
+}
+
+/**
+ * pin the calling thread to one CPU. Failure is logged but not fatal.
+ *
+ * @param cpu number of the CPU
+ */
+void pin_to_cpu(unsigned cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+        errno = err;
+        print_e(LOG_WARN, "could not pin thread to CPU %u", cpu);
+    }
+}
+
+/**
+ * messages go through a bounded ring (Vyukov's MPMC queue, used with any
+ * number of producers and one consumer at a time) into a writer thread,
+ * so the forwarding threads never block on stdout or the journal
+ */
+#define LOG_SLOTS       1024    // power of 2
+#define LOG_LINE_SIZE   240
+#define LOG_SITE_BURST  10      // messages per second and call site
+
+typedef struct {
+    uint64_t seq;
+    bool to_stderr;
+    uint16_t len;
+    char text[LOG_LINE_SIZE];
+} log_slot_t;
+
+static log_slot_t log_ring[LOG_SLOTS];
+static uint64_t log_tail = 0;           // next slot claimed by a producer
+static uint64_t log_head = 0;           // next slot to write, changed only with log_lock
+static uint64_t log_dropped = 0;        // messages lost to a full ring
+static uint32_t log_sleeping = 0;       // futex the writer waits on
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+/**
+ * write all complete messages of the ring, the caller holds log_lock
+ */
+static void log_drain() {
+    uint64_t head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    while (1) {
+        log_slot_t* slot = &log_ring[head & (LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1) {
+            break;
+        }
+        FILE* f = slot->to_stderr ? stderr : stdout;
+        fwrite(slot->text, 1, slot->len, f);
+        fputc('\n', f);
+        __atomic_store_n(&slot->seq, head + LOG_SLOTS, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_head, ++head, __ATOMIC_RELAXED);
+    }
+    uint64_t dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        fprintf(stdout, "<%d>log buffer full, %lu messages dropped\n", LOG_WARN, dropped);
+    }
     fflush(stdout);
+    fflush(stderr);
+}
+
+/**
+ * write out everything queued so far, also registered with atexit() so the
+ * last messages before a fatal exit() are not lost
+ */
+void log_flush() {
+    pthread_mutex_lock(&log_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * the writer thread, sleeps on the futex until a producer wakes it
+ */
+static void* log_writer(void* arg) {
+    (void)arg;
+    struct timespec timeout = {1, 0};
+    while (1) {
+        log_flush();
+        __atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+        uint64_t head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        log_slot_t* slot = &log_ring[head & (LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != head + 1) {
+            syscall(SYS_futex, &log_sleeping, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0);
+        }
+        __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/**
+ * prepare the ring and start the writer with all signals blocked, the
+ * signal thread of the metrics relies on nobody else taking SIGUSR1
+ */
+static void log_start() {
+    for (unsigned i = 0; i < LOG_SLOTS; ++i) {
+        log_ring[i].seq = i;
+    }
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_writer, NULL) == 0) {
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    atexit(log_flush);
+}
+
+/**
+ * allow LOG_SITE_BURST messages per second and call site
+ *
+ * @param site rate limit state of the call site
+ * @param suppressed set to the messages dropped before this one
+ * @return true if the message may be logged
+ */
+static bool log_allow(log_site_t* site, uint32_t* suppressed) {
+    uint64_t second = millisec() / 1000;
+    uint64_t window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        if (window >> 32 != second) {
+            next = second << 32 | 1;
+        } else if ((window & 0xffffffff) < LOG_SITE_BURST) {
+            next = window + 1;
+        } else {
+            __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&site->window, &window, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * claim a slot of the ring and copy the message into it, drops the message
+ * when the writer fell behind by a whole ring
+ */
+static void log_enqueue(const char* text, unsigned len, bool to_stderr) {
+    uint64_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    log_slot_t* slot;
+    while (1) {
+        slot = &log_ring[pos & (LOG_SLOTS - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(slot->text, text, len);
+    slot->len = len;
+    slot->to_stderr = to_stderr;
+    // sequentially consistent, pairs with the writer checking the ring after it set log_sleeping
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &log_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
 }
 
 /**
- * like print() but appends errno and strerror to the output
+ * format a message, prefix it with <level> for prety systemd log level
+ * coloring and queue it for the writer thread. Called by the print() and
+ * print_e() macros, lines longer than LOG_LINE_SIZE are cut.
+ *
+ * @param site rate limit state of the call site
+ * @param level log level
+ * @param with_errno append errno and strerror and write to stderr
+ * @param fmt format string for printf
+ * @param ... args for printf
  */
-void print_e(log_level_t level, char* fmt, ...) {
-    fprintf(stderr, "<%d>", level);
+void log_print(log_site_t* site, log_level_t level, bool with_errno, const char* fmt, ...) {
+    int err = errno;
+    pthread_once(&log_once, log_start);
+    uint32_t suppressed;
+    if (!log_allow(site, &suppressed)) {
+        errno = err;
+        return;
+    }
+    char line[LOG_LINE_SIZE];
+    unsigned len = snprintf(line, sizeof(line), "<%d>", level);
     va_list arglist;
     va_start(arglist, fmt);
-    vfprintf(stderr, fmt, arglist);
+    len += vsnprintf(line + len, sizeof(line) - len, fmt, arglist);
     va_end(arglist);
-    if (errno) {
-        fprintf(stderr, ": (%d) %s\n", errno, strerror(errno));
-    } else {
-        fprintf(stderr, "\n");
+    if (with_errno && err && len < sizeof(line)) {
+        char buf[128];
+        len += snprintf(line + len, sizeof(line) - len, ": (%d) %s", err, strerror_r(err, buf, sizeof(buf)));
+    }
+    if (suppressed && len < sizeof(line)) {
+        len += snprintf(line + len, sizeof(line) - len, " (%u similar messages suppressed)", suppressed);
     }
-}
\ No newline at end of file
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    log_enqueue(line, len, with_errno);
+    errno = err;
+}
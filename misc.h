@@ -2,6 +2,7 @@
 #define MISC_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef enum {
     LOG_EMERGENCY = 0,
@@ -15,7 +16,50 @@ typedef enum {
 } log_level_t;
 
 uint64_t millisec();
-void print(log_level_t level, char* fmt, ...);
-void print_e(log_level_t level, char* fmt, ...);
+uint64_t realtime_millisec();
+uint64_t realtime_nanosec();
+uint64_t clock_update();
+uint64_t clock_now();
+void pin_to_cpu(unsigned cpu);
+
+/**
+ * messages with a level above this are compiled out together with the
+ * evaluation of their arguments, `make log_level=6` drops the debug ones
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_DEBUG
+#endif
+
+/**
+ * rate limit state of one call site of print() or print_e()
+ */
+typedef struct {
+    uint64_t window;        // second of the window in the upper half, messages in it in the lower
+    uint32_t suppressed;    // messages dropped since the last one that got through
+} log_site_t;
+
+void log_print(log_site_t* site, log_level_t level, bool with_errno, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+void log_flush();
+
+/**
+ * queue a message for stdout, prefixed with <level> for systemd
+ */
+#define print(level, ...) do { \
+        if ((level) <= LOG_LEVEL_MAX) { \
+            static log_site_t log_site_; \
+            log_print(&log_site_, level, false, __VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+ * like print() but for stderr, with errno and strerror appended
+ */
+#define print_e(level, ...) do { \
+        if ((level) <= LOG_LEVEL_MAX) { \
+            static log_site_t log_site_; \
+            log_print(&log_site_, level, true, __VA_ARGS__); \
+        } \
+    } while (0)
 
 #endif
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include "pending.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "connlist.h"
+#include "defines.h"
+#include "metrics.h"
+#include "misc.h"
+#include "udp.h"
+
+/**
+ * Datagrams of new clients that arrive while the outside agent has no
+ * spare tunnel are held here until the next tunnel registers, instead of
+ * dropping them and letting the client retry seconds later. All memory is
+ * allocated once at startup: a pool of fixed size slots shared by all
+ * clients, every waiting client may hold a few of them and no datagram
+ * is held longer than PENDING_MAX_AGE_MS. Like the connection table this
+ * must only be used with the table lock held, except pending_send() which
+ * sends what a worker has taken out of the queue after the lock is released.
+ */
+
+typedef struct {
+    int next;           // next slot in the same queue or in the free list, -1 at the end
+    uint16_t len;
+    uint64_t time;      // arrival time of the datagram
+} pending_slot_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    uint64_t since;     // arrival time of the first datagram, for the flush latency
+    int head;
+    int tail;
+    unsigned count;
+} pending_client_t;
+
+static pending_slot_t* slots = NULL;
+static char* data_area = NULL;
+static int free_slots = -1;
+static pending_client_t clients[PENDING_MAX_CLIENTS];
+
+typedef struct {
+    char* data;
+    struct mmsghdr* msgs;
+    struct iovec* iovecs;
+    struct sockaddr_in* addrs;
+    unsigned count;
+    unsigned size;
+} pending_outbox_t;
+
+static __thread pending_outbox_t outbox;    // taken out of the queue, not sent yet
+
+static unsigned depth = 0;
+static unsigned depth_max = 0;
+static uint64_t stat_flushed = 0;
+static uint64_t stat_latency_sum = 0;
+static uint64_t stat_latency_max = 0;
+static uint64_t stat_overflow = 0;
+static uint64_t stat_expired = 0;
+
+#define SLOT_DATA(i) (data_area + (size_t)(i) * PENDING_SLOT_SIZE)
+
+/**
+ * allocate the slot pool, 0 slots disables holding datagrams entirely.
+ */
+void pending_init(unsigned count) {
+    if (count == 0) {
+        return;
+    }
+    slots = calloc(count, sizeof(pending_slot_t));
+    data_area = malloc((size_t)count * PENDING_SLOT_SIZE);
+    if (!slots || !data_area) {
+        print_e(LOG_ERROR, "could not allocate %u slots for pending datagrams", count);
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        slots[i].next = (i + 1 < count) ? (int)i + 1 : -1;
+    }
+    free_slots = 0;
+}
+
+static int pop_head(pending_client_t* c) {
+    int i = c->head;
+    c->head = slots[i].next;
+    if (c->head < 0) {
+        c->tail = -1;
+    }
+    --c->count;
+    --depth;
+    return i;
+}
+
+static void free_slot(int i) {
+    slots[i].next = free_slots;
+    free_slots = i;
+}
+
+/**
+ * drop all held datagrams that are too old to be of any use anymore
+ */
+static void expire(uint64_t now) {
+    for (unsigned k = 0; k < PENDING_MAX_CLIENTS; ++k) {
+        pending_client_t* c = &clients[k];
+        while (c->count && (now - slots[c->head].time > PENDING_MAX_AGE_MS)) {
+            free_slot(pop_head(c));
+            ++stat_expired;
+        }
+        if (c->count) {
+            c->since = slots[c->head].time;
+        }
+    }
+}
+
+/**
+ * hold a datagram of a client for which there is no tunnel yet.
+ *
+ * @param client source address of the datagram
+ * @param data pointer to the datagram
+ * @param len length of the datagram
+ * @param now current time in milliseconds
+ * @return false if the datagram could not be held and must be dropped
+ */
+bool pending_add(struct sockaddr_in* client, const char* data, size_t len, uint64_t now) {
+    if (slots == NULL) {
+        return false;
+    }
+    expire(now);
+
+    pending_client_t* c = NULL;
+    pending_client_t* unused = NULL;
+    for (unsigned k = 0; k < PENDING_MAX_CLIENTS; ++k) {
+        if (clients[k].count == 0) {
+            if (!unused) {
+                unused = &clients[k];
+            }
+        } else if (memcmp(&clients[k].addr, client, sizeof(struct sockaddr_in)) == 0) {
+            c = &clients[k];
+            break;
+        }
+    }
+    if (!c) {
+        c = unused;
+    }
+    if (!c || (c->count >= PENDING_PER_CLIENT) || (free_slots < 0) || (len > PENDING_SLOT_SIZE)) {
+        ++stat_overflow;
+        return false;
+    }
+
+    int i = free_slots;
+    free_slots = slots[i].next;
+    slots[i].next = -1;
+    slots[i].len = len;
+    slots[i].time = now;
+    memcpy(SLOT_DATA(i), data, len);
+    if (c->count == 0) {
+        c->addr = *client;
+        c->since = now;
+        c->head = i;
+    } else {
+        slots[c->tail].next = i;
+    }
+    c->tail = i;
+    ++c->count;
+    if (++depth > depth_max) {
+        depth_max = depth;
+    }
+    return true;
+}
+
+/**
+ * make sure the outbox of the calling thread has room for more datagrams.
+ * It grows as needed, a batch may bring up many tunnels at once and each
+ * of them may take the queue of a client.
+ */
+static bool outbox_room(unsigned count) {
+    if (outbox.count + count <= outbox.size) {
+        return true;
+    }
+    unsigned size = outbox.size ? outbox.size : PENDING_OUTBOX;
+    while (size < outbox.count + count) {
+        size *= 2;
+    }
+    char* data = realloc(outbox.data, (size_t)size * PENDING_SLOT_SIZE);
+    if (data) {
+        outbox.data = data;
+    }
+    struct mmsghdr* msgs = realloc(outbox.msgs, size * sizeof(struct mmsghdr));
+    if (msgs) {
+        outbox.msgs = msgs;
+    }
+    struct iovec* iovecs = realloc(outbox.iovecs, size * sizeof(struct iovec));
+    if (iovecs) {
+        outbox.iovecs = iovecs;
+    }
+    struct sockaddr_in* addrs = realloc(outbox.addrs, size * sizeof(struct sockaddr_in));
+    if (addrs) {
+        outbox.addrs = addrs;
+    }
+    if (!data || !msgs || !iovecs || !addrs) {
+        print_e(LOG_ERROR, "could not grow the outbox for held datagrams to %u", size);
+        return false;
+    }
+
+    // the arrays may have moved, so link everything up again
+    for (unsigned i = 0; i < size; ++i) {
+        memset(&outbox.msgs[i], 0, sizeof(struct mmsghdr));
+        outbox.iovecs[i].iov_base = outbox.data + (size_t)i * PENDING_SLOT_SIZE;
+        outbox.msgs[i].msg_hdr.msg_iov = &outbox.iovecs[i];
+        outbox.msgs[i].msg_hdr.msg_iovlen = 1;
+        outbox.msgs[i].msg_hdr.msg_name = &outbox.addrs[i];
+        outbox.msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    outbox.size = size;
+    return true;
+}
+
+/**
+ * move all held datagrams of a client to the outbox of the calling thread,
+ * addressed to its new tunnel. There must be room for them.
+ */
+static void take(pending_client_t* c, struct sockaddr_in* tunnel, unsigned* count, size_t* bytes, uint64_t now) {
+    uint64_t latency = now - c->since;
+    *count = c->count;
+    *bytes = 0;
+    while (c->count) {
+        int i = pop_head(c);
+        unsigned k = outbox.count++;
+        memcpy(outbox.iovecs[k].iov_base, SLOT_DATA(i), slots[i].len);
+        outbox.iovecs[k].iov_len = slots[i].len;
+        outbox.addrs[k] = *tunnel;
+        *bytes += slots[i].len;
+        free_slot(i);
+    }
+
+    ++stat_flushed;
+    stat_latency_sum += latency;
+    if (latency > stat_latency_max) {
+        stat_latency_max = latency;
+    }
+    print(LOG_DEBUG, "flushed %u held datagram(s) of %s:%d after %lu ms", *count, inet_ntoa(c->addr.sin_addr), c->addr.sin_port, latency);
+}
+
+/**
+ * take all held datagrams of the client that has been waiting longest out
+ * of the queue, for a tunnel that has just become available. They are
+ * copied to the outbox of the calling thread and go out with the next
+ * pending_send(), so that no system call is made with the table lock held.
+ * Clients that already got a tunnel are left alone, and if the outbox
+ * can't grow for the queue of the oldest one a shorter one gets the tunnel.
+ *
+ * @param tunnel address of the new tunnel
+ * @param client will receive the address of the client
+ * @param count will receive the number of datagrams taken
+ * @param bytes will receive the number of bytes taken
+ * @param now current time in milliseconds
+ * @return false if no client is waiting or none fits into the outbox
+ */
+bool pending_flush_oldest(struct sockaddr_in* tunnel, struct sockaddr_in* client, unsigned* count, size_t* bytes, uint64_t now) {
+    if (slots == NULL) {
+        return false;
+    }
+    expire(now);
+
+    pending_client_t* c = NULL;
+    for (unsigned k = 0; k < PENDING_MAX_CLIENTS; ++k) {
+        pending_client_t* w = &clients[k];
+        if (w->count && (!c || (w->since < c->since)) && outbox_room(w->count) && !conn_table_find_client_address(&w->addr)) {
+            c = w;
+        }
+    }
+    if (!c) {
+        return false;
+    }
+    *client = c->addr;
+    take(c, tunnel, count, bytes, now);
+    return true;
+}
+
+/**
+ * take the held datagrams of a client that has just been given a tunnel
+ * by one of its own datagrams, so that they go out in front of it like
+ * with pending_flush_oldest(). If the outbox can't grow for them they are
+ * dropped, they must not wait for another tunnel.
+ *
+ * @param client address of the client
+ * @param tunnel address of its tunnel
+ * @param count will receive the number of datagrams taken
+ * @param bytes will receive the number of bytes taken
+ * @param now current time in milliseconds
+ * @return false if nothing was taken
+ */
+bool pending_take(struct sockaddr_in* client, struct sockaddr_in* tunnel, unsigned* count, size_t* bytes, uint64_t now) {
+    if (slots == NULL) {
+        return false;
+    }
+    for (unsigned k = 0; k < PENDING_MAX_CLIENTS; ++k) {
+        pending_client_t* c = &clients[k];
+        if (c->count && (memcmp(&c->addr, client, sizeof(struct sockaddr_in)) == 0)) {
+            if (outbox_room(c->count)) {
+                take(c, tunnel, count, bytes, now);
+                return true;
+            }
+            while (c->count) {
+                free_slot(pop_head(c));
+                ++stat_overflow;
+            }
+            return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * send what pending_flush_oldest() has put into the outbox of the calling
+ * thread, to be called without the table lock held.
+ *
+ * @param sockfd socket to send from
+ */
+void pending_send(int sockfd) {
+    if (!outbox.count) {
+        return;
+    }
+    METRIC_ADD(drop_send_error, udp_send_batch(sockfd, outbox.msgs, outbox.count));
+    outbox.count = 0;
+}
+
+/**
+ * log the queue statistics since the last call, if there was anything
+ */
+void pending_print_stats(uint64_t now) {
+    if (slots == NULL) {
+        return;
+    }
+    expire(now);
+    if (depth_max || stat_overflow || stat_expired) {
+        print(LOG_DEBUG, "pending datagrams: %u held (max %u), %lu client(s) flushed (latency avg %lu ms, max %lu ms), %lu dropped on overflow, %lu expired",
+            depth, depth_max, stat_flushed, stat_flushed ? stat_latency_sum / stat_flushed : 0, stat_latency_max, stat_overflow, stat_expired);
+    }
+    depth_max = depth;
+    stat_flushed = 0;
+    stat_latency_sum = 0;
+    stat_latency_max = 0;
+    stat_overflow = 0;
+    stat_expired = 0;
+}
@@ -0,0 +1,16 @@
+#ifndef PENDING_H
+#define PENDING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+void pending_init(unsigned slots);
+bool pending_add(struct sockaddr_in* client, const char* data, size_t len, uint64_t now);
+bool pending_flush_oldest(struct sockaddr_in* tunnel, struct sockaddr_in* client, unsigned* count, size_t* bytes, uint64_t now);
+bool pending_take(struct sockaddr_in* client, struct sockaddr_in* tunnel, unsigned* count, size_t* bytes, uint64_t now);
+void pending_send(int sockfd);
+void pending_print_stats(uint64_t now);
+
+#endif // PENDING_H
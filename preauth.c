@@ -0,0 +1,117 @@
+#include "preauth.h"
+
+#include "defines.h"
+#include "mac.h"
+#include "metrics.h"
+#include "misc.h"
+
+/**
+ * Cheap checks that every keepalive sized datagram has to pass before
+ * its authentication code is calculated, so that a flood of junk can not
+ * keep the outside agent busy hashing. The checks are, in this order:
+ *
+ * 1. the nonce must not have been used yet, not be too old for the replay
+ *    window and not lie further in the future than NONCE_MAX_AHEAD_MS.
+ *    The nonces are millisecond timestamps, random junk practically never
+ *    passes.
+ *
+ * 2. every source IP has a token bucket, each datagram reaching the hash
+ *    stage costs one token. This limits the hashing an attacker can cause
+ *    with well formed nonces from a single address. Tunnel addresses that
+ *    are already in the connection table are exempt: the inside agent sends
+ *    the keepalives of all its tunnels from one IP, with enough tunnels
+ *    they would exceed the rate, and anybody spoofing that IP could keep
+ *    the real keepalives out. So only new tunnels can be held up this way.
+ *
+ * Datagrams rejected here are not dropped, they just can't be keepalives
+ * and are routed like any other datagram. All of this is called by the
+ * workers without holding the table lock, the caller looks up whether the
+ * source is a known tunnel.
+ */
+
+#define BUCKET_TOKEN_BITS 24
+
+static uint64_t buckets[PREAUTH_BUCKETS];   // time of last refill << 24 | tokens
+
+static metrics_t last_printed = {0};
+
+/**
+ * take a token from the bucket of an IP address. The time of the last
+ * refill and the number of tokens are packed into one word and updated
+ * with a single compare and swap. Different addresses may share a bucket.
+ */
+static bool take_token(uint32_t ip, uint64_t now) {
+    uint64_t* b = &buckets[(ip * 0x9e3779b1) >> 20 & (PREAUTH_BUCKETS - 1)];
+    uint64_t old = __atomic_load_n(b, __ATOMIC_RELAXED);
+    uint64_t new;
+    do {
+        uint64_t last = old >> BUCKET_TOKEN_BITS;
+        uint64_t tokens = old & ((1 << BUCKET_TOKEN_BITS) - 1);
+        if (last == 0) {
+            last = now;
+            tokens = PREAUTH_BURST;
+        }
+        uint64_t refill = (now - last) * PREAUTH_RATE / 1000;
+        if (refill) {
+            tokens = (tokens + refill > PREAUTH_BURST) ? PREAUTH_BURST : tokens + refill;
+            last = now;
+        }
+        if (tokens == 0) {
+            return false;
+        }
+        new = last << BUCKET_TOKEN_BITS | (tokens - 1);
+    } while (!__atomic_compare_exchange_n(b, &old, new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+/**
+ * decide whether a keepalive sized datagram is worth checking its
+ * authentication code.
+ *
+ * @param src source address of the datagram
+ * @param nonce the nonce of the code
+ * @param known the source is the address of a tunnel in the table
+ * @return true if the code should be checked
+ */
+bool preauth_check(struct sockaddr_in* src, uint64_t nonce, bool known) {
+    if (!mac_nonce_fresh(nonce) || (nonce > realtime_millisec() + NONCE_MAX_AHEAD_MS)) {
+        METRIC_INC(keepalive_nonce);
+        return false;
+    }
+    if (!known && !take_token(src->sin_addr.s_addr, clock_now())) {
+        METRIC_INC(keepalive_rate);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * count the result of checking the code of a datagram that passed
+ * preauth_check()
+ */
+void preauth_result(bool valid) {
+    if (valid) {
+        METRIC_INC(keepalive_received);
+    } else {
+        METRIC_INC(keepalive_mac);
+    }
+}
+
+/**
+ * log the counters since the last call, if there was anything. The
+ * counters themselves are the per-thread metrics, only the differences
+ * are logged. Must only be called from one thread.
+ */
+void preauth_print_stats(void) {
+    metrics_t m;
+    metrics_sum(&m);
+    uint64_t passed = m.keepalive_received - last_printed.keepalive_received;
+    uint64_t nonce = m.keepalive_nonce - last_printed.keepalive_nonce;
+    uint64_t rate = m.keepalive_rate - last_printed.keepalive_rate;
+    uint64_t mac = m.keepalive_mac - last_printed.keepalive_mac;
+    last_printed = m;
+    if (nonce || rate || mac) {
+        print(LOG_DEBUG, "keepalive filter: %lu passed, rejected %lu by nonce, %lu by rate limit, %lu by MAC",
+            passed, nonce, rate, mac);
+    }
+}
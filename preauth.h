@@ -0,0 +1,12 @@
+#ifndef PREAUTH_H
+#define PREAUTH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+bool preauth_check(struct sockaddr_in* src, uint64_t nonce, bool known);
+void preauth_result(bool valid);
+void preauth_print_stats(void);
+
+#endif // PREAUTH_H
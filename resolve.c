@@ -0,0 +1,177 @@
+#include "resolve.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include "defines.h"
+#include "misc.h"
+
+#define RESOLVE_MAX_ADDRS 16
+
+/**
+ * The outside host may sit behind a dynamic DNS name. A thread of its own
+ * looks the name up again whenever the TTL of the answer has run out (but
+ * not more often than RESOLVE_MIN_SECONDS and at least every max_interval
+ * seconds) and reports when the address we use is no longer among the
+ * ones the name resolves to. The lookups may block for as long as the
+ * resolver likes without holding up anything else.
+ */
+
+typedef struct {
+    const char* host;
+    struct in_addr addr;
+    unsigned max_interval;
+    void (*changed)(struct in_addr addr);
+} watch_t;
+
+static watch_t watch;
+
+/**
+ * resolve a host name to an IPv4 address with getaddrinfo(), which also
+ * knows /etc/hosts and other sources besides DNS. For the startup, it
+ * blocks until there is an answer.
+ *
+ * @param host name or dotted quad
+ * @param addr receives the first address
+ * @return false if the name could not be resolved
+ */
+bool resolve_host(const char* host, struct in_addr* addr) {
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM
+    };
+    struct addrinfo* res;
+    int err = getaddrinfo(host, NULL, &hints, &res);
+    if (err) {
+        print(LOG_ERROR, "host name '%s' could not be resolved: %s", host, gai_strerror(err));
+        return false;
+    }
+    *addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return true;
+}
+
+/**
+ * the TTL of the A records of the name, straight from DNS as getaddrinfo()
+ * does not tell how long its answer is valid. For names DNS does not
+ * know, for example those only in /etc/hosts, it is max_interval.
+ *
+ * @return TTL in seconds
+ */
+static unsigned lookup_ttl() {
+    unsigned char answer[4096];
+    unsigned ttl = watch.max_interval;
+    struct __res_state state;
+    memset(&state, 0, sizeof(state));
+    if (res_ninit(&state) < 0) {
+        return ttl;
+    }
+    int len = res_nsearch(&state, watch.host, ns_c_in, ns_t_a, answer, sizeof(answer));
+    ns_msg msg;
+    if ((len > 0) && (ns_initparse(answer, len, &msg) == 0)) {
+        for (int i = 0; i < ns_msg_count(msg, ns_s_an); ++i) {
+            ns_rr rr;
+            if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+                break;
+            }
+            if (ns_rr_ttl(rr) < ttl) {
+                ttl = ns_rr_ttl(rr);
+            }
+        }
+    }
+    res_nclose(&state);
+    return ttl;
+}
+
+/**
+ * resolve the name the same way as at startup, so a name with several
+ * sources never looks like it moved just because they disagree
+ *
+ * @param addrs receives up to RESOLVE_MAX_ADDRS addresses
+ * @return number of addresses, 0 if the lookup failed
+ */
+static unsigned lookup(struct in_addr* addrs) {
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM
+    };
+    struct addrinfo* res;
+    unsigned count = 0;
+    if (getaddrinfo(watch.host, NULL, &hints, &res) == 0) {
+        for (struct addrinfo* ai = res; ai && (count < RESOLVE_MAX_ADDRS); ai = ai->ai_next) {
+            addrs[count++] = ((struct sockaddr_in*)ai->ai_addr)->sin_addr;
+        }
+        freeaddrinfo(res);
+    }
+    return count;
+}
+
+static void* run_watch(void* arg) {
+    (void)arg;
+    unsigned interval = lookup_ttl();
+    bool failed = false;
+    while ("the wind cries Mary") {
+        sleep((interval < RESOLVE_MIN_SECONDS) ? RESOLVE_MIN_SECONDS : interval);
+
+        struct in_addr addrs[RESOLVE_MAX_ADDRS];
+        unsigned count = lookup(addrs);
+        if (count == 0) {
+            if (!failed) {
+                print(LOG_WARN, "outside host name '%s' could not be resolved, keeping %s", watch.host, inet_ntoa(watch.addr));
+                failed = true;
+            }
+            interval = (watch.max_interval < RESOLVE_RETRY_SECONDS) ? watch.max_interval : RESOLVE_RETRY_SECONDS;
+            continue;
+        }
+        failed = false;
+        interval = lookup_ttl();
+
+        // with several addresses for the name we stay with ours as long as it is one of them
+        bool found = false;
+        for (unsigned i = 0; i < count; ++i) {
+            found |= (addrs[i].s_addr == watch.addr.s_addr);
+        }
+        if (!found) {
+            char old[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &watch.addr, old, sizeof(old));
+            print(LOG_NOTICE, "outside host '%s' moved from %s to %s", watch.host, old, inet_ntoa(addrs[0]));
+            watch.addr = addrs[0];
+            watch.changed(addrs[0]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * start the thread that keeps resolving the host name. Nothing happens
+ * for a dotted quad or with a max_interval of 0.
+ *
+ * @param host name of the host
+ * @param addr the address it resolved to at startup
+ * @param max_interval longest time between two lookups in seconds
+ * @param changed called from the thread with the new address when it changed
+ */
+void resolve_watch(const char* host, struct in_addr addr, unsigned max_interval, void (*changed)(struct in_addr addr)) {
+    struct in_addr literal;
+    if ((max_interval == 0) || inet_aton(host, &literal)) {
+        return;
+    }
+    watch.host = host;
+    watch.addr = addr;
+    watch.max_interval = max_interval;
+    watch.changed = changed;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_watch, NULL) != 0) {
+        print_e(LOG_ERROR, "could not start resolver thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    print(LOG_INFO, "looking up '%s' again at least every %u seconds", host, max_interval);
+}
@@ -0,0 +1,10 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+bool resolve_host(const char* host, struct in_addr* addr);
+void resolve_watch(const char* host, struct in_addr addr, unsigned max_interval, void (*changed)(struct in_addr addr));
+
+#endif // RESOLVE_H
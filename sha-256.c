@@ -5,6 +5,12 @@
 
 #include "sha-256.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
 #define TOTAL_LEN_LEN 8
 
 /*
@@ -12,6 +18,29 @@
 * When useful for clarification, portions of the pseudo-code are reproduced here too.
 */
 
+/*
+* Initialize array of round constants:
+* (first 32 bits of the fractional parts of the cube roots of the first 64 primes 2..311):
+*/
+static const uint32_t k[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2};
+
+/*
+* Initialize hash values (first 32 bits of the fractional parts of the square roots of the first 8 primes
+* 2..19):
+*/
+static const uint32_t h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
 /**
  * @brief Rotate a 32-bit value by a number of bits to the right.
  * @param value The value to be rotated.
@@ -30,9 +59,10 @@ static inline uint32_t right_rot(uint32_t value, unsigned int count) {
  * @param h Pointer to the first hash item, of a total of eight.
  * @param p Pointer to the chunk data, which has a standard length.
  *
- * @note This is the SHA-256 work horse.
+ * @note This is the SHA-256 work horse in portable C. It is used when the CPU offers nothing better and serves as the
+ * reference for the accelerated versions below.
  */
-static inline void consume_chunk(uint32_t *h, const uint8_t *p) {
+static void consume_chunk_scalar(uint32_t *h, const uint8_t *p) {
     unsigned i, j;
     uint32_t ah[8];
 
@@ -74,22 +104,6 @@ static inline void consume_chunk(uint32_t *h, const uint8_t *p) {
             const uint32_t s1 = right_rot(ah[4], 6) ^ right_rot(ah[4], 11) ^ right_rot(ah[4], 25);
             const uint32_t ch = (ah[4] & ah[5]) ^ (~ah[4] & ah[6]);
 
-            /*
-            * Initialize array of round constants:
-            * (first 32 bits of the fractional parts of the cube roots of the first 64 primes 2..311):
-            */
-            static const uint32_t k[] = {
-                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
-                0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
-                0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
-                0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
-                0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
-                0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
-                0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
-                0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
-                0xc67178f2};
-
             const uint32_t temp1 = ah[7] + s1 + ch + k[i << 4 | j] + w[j];
             const uint32_t s0 = right_rot(ah[0], 2) ^ right_rot(ah[0], 13) ^ right_rot(ah[0], 22);
             const uint32_t maj = (ah[0] & ah[1]) ^ (ah[0] & ah[2]) ^ (ah[1] & ah[2]);
@@ -111,27 +125,177 @@ static inline void consume_chunk(uint32_t *h, const uint8_t *p) {
         h[i] += ah[i];
 }
 
+#ifdef HAVE_X86_KERNELS
+
+/**
+ * @brief Update a hash value with a new chunk of data, using the SHA extensions (SHA-NI).
+ *
+ * @note The sha256rnds2 instruction does two rounds and keeps the state in the order ABEF/CDGH, it is shuffled in and
+ * out of that order once per chunk. sha256msg1/sha256msg2 extend the message schedule four words at a time.
+ */
+__attribute__((target("sha,sse4.1")))
+static void consume_chunk_shani(uint32_t *h, const uint8_t *p) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i msg[4];
+    __m128i tmp, state0, state1, abef_save, cdgh_save;
+
+    /* Load the state and bring it into ABEF/CDGH order */
+    tmp = _mm_loadu_si128((const __m128i *)&h[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&h[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+    abef_save = state0;
+    cdgh_save = state1;
+
+    for (unsigned i = 0; i < 4; i++)
+        msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+
+    /* 16 groups of 4 rounds each */
+    for (unsigned g = 0; g < 16; g++) {
+        __m128i m = msg[g & 3];
+        if (g >= 4) {
+            /* w[t] = w[t-16] + s0(w[t-15]) + w[t-7] + s1(w[t-2]) for four consecutive t */
+            m = _mm_sha256msg1_epu32(msg[g & 3], msg[(g + 1) & 3]);
+            m = _mm_add_epi32(m, _mm_alignr_epi8(msg[(g + 3) & 3], msg[(g + 2) & 3], 4));
+            m = _mm_sha256msg2_epu32(m, msg[(g + 3) & 3]);
+            msg[g & 3] = m;
+        }
+        __m128i wk = _mm_add_epi32(m, _mm_loadu_si128((const __m128i *)&k[4 * g]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+        wk = _mm_shuffle_epi32(wk, 0x0e);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+    }
+
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+
+    /* Back to the usual ABCD/EFGH order */
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+
+#define ROR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+/**
+ * @brief Update eight independent hash values with one chunk each, using AVX2.
+ * @param h The eight hash values, h[i] holds word i of all eight lanes.
+ * @param p Pointers to the eight chunks.
+ *
+ * @note Every 32-bit lane of the vector registers runs its own SHA-256, this has the same per message cost as the
+ * scalar code but processes eight messages at once.
+ */
+__attribute__((target("avx2")))
+static void consume_chunk_avx2_x8(__m256i h[8], const uint8_t *const p[8]) {
+    __m256i w[16];
+    __m256i ah[8];
+    unsigned i, j;
+
+    for (i = 0; i < 8; i++)
+        ah[i] = h[i];
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 16; j++) {
+            if (i == 0) {
+                uint32_t v[8];
+                for (unsigned l = 0; l < 8; l++) {
+                    const uint8_t *q = p[l] + 4 * j;
+                    v[l] = (uint32_t)q[0] << 24 | (uint32_t)q[1] << 16 | (uint32_t)q[2] << 8 | (uint32_t)q[3];
+                }
+                w[j] = _mm256_loadu_si256((const __m256i *)v);
+            } else {
+                const __m256i w1 = w[(j + 1) & 0xf];
+                const __m256i w14 = w[(j + 14) & 0xf];
+                const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR8(w1, 7), ROR8(w1, 18)), _mm256_srli_epi32(w1, 3));
+                const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR8(w14, 17), ROR8(w14, 19)), _mm256_srli_epi32(w14, 10));
+                w[j] = _mm256_add_epi32(_mm256_add_epi32(w[j], s0), _mm256_add_epi32(w[(j + 9) & 0xf], s1));
+            }
+            const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR8(ah[4], 6), ROR8(ah[4], 11)), ROR8(ah[4], 25));
+            const __m256i ch = _mm256_xor_si256(_mm256_and_si256(ah[4], ah[5]), _mm256_andnot_si256(ah[4], ah[6]));
+            const __m256i temp1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(ah[7], s1), _mm256_add_epi32(ch, w[j])),
+                                                   _mm256_set1_epi32((int)k[i << 4 | j]));
+            const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR8(ah[0], 2), ROR8(ah[0], 13)), ROR8(ah[0], 22));
+            const __m256i maj = _mm256_xor_si256(_mm256_and_si256(ah[0], _mm256_xor_si256(ah[1], ah[2])), _mm256_and_si256(ah[1], ah[2]));
+            const __m256i temp2 = _mm256_add_epi32(s0, maj);
+
+            ah[7] = ah[6];
+            ah[6] = ah[5];
+            ah[5] = ah[4];
+            ah[4] = _mm256_add_epi32(ah[3], temp1);
+            ah[3] = ah[2];
+            ah[2] = ah[1];
+            ah[1] = ah[0];
+            ah[0] = _mm256_add_epi32(temp1, temp2);
+        }
+    }
+
+    for (i = 0; i < 8; i++)
+        h[i] = _mm256_add_epi32(h[i], ah[i]);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+/*
+* The kernels are selected once at startup, depending on what the CPU supports.
+*/
+static void (*consume_chunk)(uint32_t *h, const uint8_t *p) = consume_chunk_scalar;
+static enum sha_256_impl multi_impl = SHA_256_IMPL_SCALAR;
+
+/* one bit (1 << impl) for every implementation the CPU supports, the features are independent */
+static unsigned detect(void) {
+    unsigned supported = 1u << SHA_256_IMPL_SCALAR;
+#ifdef HAVE_X86_KERNELS
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA) && __builtin_cpu_supports("sse4.1"))
+        supported |= 1u << SHA_256_IMPL_SHANI;
+    if (__builtin_cpu_supports("avx2"))
+        supported |= 1u << SHA_256_IMPL_AVX2;
+#endif
+    return supported;
+}
+
+__attribute__((constructor))
+static void select_default(void) {
+    sha_256_select(SHA_256_IMPL_AUTO);
+}
+
 /*
 * Public functions. See header file for documentation.
 */
 
+enum sha_256_impl sha_256_select(enum sha_256_impl impl) {
+    unsigned supported = detect();
+    if (impl == SHA_256_IMPL_AUTO || !(supported & (1u << impl))) {
+        impl = SHA_256_IMPL_SHANI;
+        while (!(supported & (1u << impl)))
+            impl--;
+    }
+    /* AVX2 has no single buffer kernel, with it single hashes use the scalar code */
+    consume_chunk = consume_chunk_scalar;
+    multi_impl = impl;
+#ifdef HAVE_X86_KERNELS
+    if (impl == SHA_256_IMPL_SHANI)
+        consume_chunk = consume_chunk_shani;
+#endif
+    return impl;
+}
+
+const char *sha_256_impl_name(void) {
+    static const char *const names[] = {"auto", "scalar", "avx2", "sha-ni"};
+    return names[multi_impl];
+}
+
 void sha_256_init(struct Sha_256 *sha_256, uint8_t hash[SIZE_OF_SHA_256_HASH]) {
     sha_256->hash = hash;
     sha_256->chunk_pos = sha_256->chunk;
     sha_256->space_left = SIZE_OF_SHA_256_CHUNK;
     sha_256->total_len = 0;
-    /*
-    * Initialize hash values (first 32 bits of the fractional parts of the square roots of the first 8 primes
-    * 2..19):
-    */
-    sha_256->h[0] = 0x6a09e667;
-    sha_256->h[1] = 0xbb67ae85;
-    sha_256->h[2] = 0x3c6ef372;
-    sha_256->h[3] = 0xa54ff53a;
-    sha_256->h[4] = 0x510e527f;
-    sha_256->h[5] = 0x9b05688c;
-    sha_256->h[6] = 0x1f83d9ab;
-    sha_256->h[7] = 0x5be0cd19;
+    memcpy(sha_256->h, h0, sizeof(h0));
 }
 
 void sha_256_write(struct Sha_256 *sha_256, const void *data, size_t len) {
@@ -219,3 +383,110 @@ void calc_sha_256(uint8_t hash[SIZE_OF_SHA_256_HASH], const void *input, size_t
     sha_256_write(&sha_256, input, len);
     (void)sha_256_close(&sha_256);
 }
+
+/**
+ * @brief Build the padded last one or two chunks of a message.
+ * @return The number of chunks in tail.
+ */
+static unsigned pad_tail(uint8_t tail[2 * SIZE_OF_SHA_256_CHUNK], const uint8_t *input, size_t len, size_t total_len) {
+    const size_t rest = len % SIZE_OF_SHA_256_CHUNK;
+    const unsigned chunks = (rest + 1 + TOTAL_LEN_LEN > SIZE_OF_SHA_256_CHUNK) ? 2 : 1;
+    uint8_t *end = tail + chunks * SIZE_OF_SHA_256_CHUNK;
+    memset(tail, 0, chunks * SIZE_OF_SHA_256_CHUNK);
+    memcpy(tail, input + len - rest, rest);
+    tail[rest] = 0x80;
+    uint64_t bits = (uint64_t)total_len << 3;
+    for (int i = 1; i <= 8; i++) {
+        end[-i] = (uint8_t)bits;
+        bits >>= 8;
+    }
+    return chunks;
+}
+
+static void store_hash(uint8_t hash[SIZE_OF_SHA_256_HASH], const uint32_t h[8]) {
+    for (int i = 0, j = 0; i < 8; i++) {
+        hash[j++] = (uint8_t)(h[i] >> 24);
+        hash[j++] = (uint8_t)(h[i] >> 16);
+        hash[j++] = (uint8_t)(h[i] >> 8);
+        hash[j++] = (uint8_t)h[i];
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static void calc_sha_256_x8(const uint32_t start[8], size_t prefix_len, uint8_t hash[][SIZE_OF_SHA_256_HASH],
+                            const void *const input[], size_t len, unsigned count) {
+    uint8_t tail[8][2 * SIZE_OF_SHA_256_CHUNK];
+    const uint8_t *p[8];
+    __m256i h[8];
+    unsigned tail_chunks = 0;
+    const size_t full = len / SIZE_OF_SHA_256_CHUNK;
+
+    /* unused lanes just hash the first message again */
+    for (unsigned l = 0; l < 8; l++)
+        tail_chunks = pad_tail(tail[l], input[l < count ? l : 0], len, prefix_len + len);
+    for (unsigned i = 0; i < 8; i++)
+        h[i] = _mm256_set1_epi32((int)start[i]);
+
+    for (size_t c = 0; c < full + tail_chunks; c++) {
+        for (unsigned l = 0; l < 8; l++) {
+            if (c < full)
+                p[l] = (const uint8_t *)input[l < count ? l : 0] + c * SIZE_OF_SHA_256_CHUNK;
+            else
+                p[l] = tail[l] + (c - full) * SIZE_OF_SHA_256_CHUNK;
+        }
+        consume_chunk_avx2_x8(h, p);
+    }
+
+    uint32_t words[8][8];
+    for (unsigned i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *)words[i], h[i]);
+    for (unsigned l = 0; l < count; l++) {
+        uint32_t hl[8];
+        for (unsigned i = 0; i < 8; i++)
+            hl[i] = words[i][l];
+        store_hash(hash[l], hl);
+    }
+}
+#endif
+
+/**
+ * @brief Continue count calculations from the same state, each with its own input, and close them.
+ */
+static void multi(const uint32_t start[8], size_t prefix_len, uint8_t hash[][SIZE_OF_SHA_256_HASH],
+                  const void *const input[], size_t len, unsigned count) {
+#ifdef HAVE_X86_KERNELS
+    if (multi_impl == SHA_256_IMPL_AVX2) {
+        for (unsigned n = 0; n < count; n += 8)
+            calc_sha_256_x8(start, prefix_len, hash + n, input + n, len, (count - n < 8) ? count - n : 8);
+        return;
+    }
+#endif
+    for (unsigned n = 0; n < count; n++) {
+        uint8_t tail[2 * SIZE_OF_SHA_256_CHUNK];
+        uint32_t h[8];
+        const size_t full = len / SIZE_OF_SHA_256_CHUNK;
+        const unsigned tail_chunks = pad_tail(tail, input[n], len, prefix_len + len);
+        memcpy(h, start, sizeof(h));
+        for (size_t c = 0; c < full; c++)
+            consume_chunk(h, (const uint8_t *)input[n] + c * SIZE_OF_SHA_256_CHUNK);
+        for (unsigned c = 0; c < tail_chunks; c++)
+            consume_chunk(h, tail + c * SIZE_OF_SHA_256_CHUNK);
+        store_hash(hash[n], h);
+    }
+}
+
+void calc_sha_256_multi(uint8_t hash[][SIZE_OF_SHA_256_HASH], const void *const input[], size_t len, unsigned count) {
+    multi(h0, 0, hash, input, len, count);
+}
+
+void sha_256_close_multi(const struct Sha_256 *sha_256, uint8_t hash[][SIZE_OF_SHA_256_HASH], const void *const input[],
+                         size_t len, unsigned count) {
+    multi(sha_256->h, sha_256->total_len, hash, input, len, count);
+}
+
+void sha_256_copy(struct Sha_256 *dst, const struct Sha_256 *src, uint8_t hash[SIZE_OF_SHA_256_HASH]) {
+    *dst = *src;
+    dst->hash = hash;
+    dst->chunk_pos = dst->chunk + (src->chunk_pos - src->chunk);
+}
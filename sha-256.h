@@ -41,6 +41,34 @@ struct Sha_256 {
 	uint32_t h[8];
 };
 
+/**
+ * @brief The implementations of the compression function, in order of preference.
+ */
+enum sha_256_impl {
+	SHA_256_IMPL_AUTO = 0,
+	SHA_256_IMPL_SCALAR,
+	SHA_256_IMPL_AVX2,
+	SHA_256_IMPL_SHANI
+};
+
+/**
+ * @brief Select the implementation of the compression function.
+ * @param impl The implementation to use, SHA_256_IMPL_AUTO for the best one the CPU supports.
+ * @return The implementation that is used from now on.
+ *
+ * @note The best implementation is selected automatically at startup. Asking for an implementation the CPU does not
+ * support falls back to the best one it does support, the portable scalar code is always available. All of them
+ * deliver identical results, this is meant for testing and benchmarking them against each other.
+ *
+ * @note Not thread safe, call it before any hash calculation is running.
+ */
+enum sha_256_impl sha_256_select(enum sha_256_impl impl);
+
+/**
+ * @brief The name of the implementation currently in use, for logging.
+ */
+const char *sha_256_impl_name(void);
+
 /**
  * @brief The simple SHA-256 calculation function.
  * @param hash Hash array, where the result is delivered.
@@ -54,6 +82,32 @@ struct Sha_256 {
  */
 void calc_sha_256(uint8_t hash[SIZE_OF_SHA_256_HASH], const void *input, size_t len);
 
+/**
+ * @brief Calculate the SHA-256 of several messages of the same length at once.
+ * @param hash Array of count hash arrays, where the results are delivered.
+ * @param input Array of count pointers to the messages.
+ * @param len Length of each message, in byte.
+ * @param count Number of messages.
+ *
+ * @note With AVX2 up to eight messages are processed in parallel. Otherwise this is the same as calling calc_sha_256()
+ * for each of them.
+ */
+void calc_sha_256_multi(uint8_t hash[][SIZE_OF_SHA_256_HASH], const void *const input[], size_t len, unsigned count);
+
+/**
+ * @brief Continue a SHA-256 streaming calculation with several different inputs of the same length, and close them.
+ * @param sha_256 A pointer to a previously initialized SHA-256 structure, it is not modified.
+ * @param hash Array of count hash arrays, where the results are delivered.
+ * @param input Array of count pointers to the data to be added to each calculation.
+ * @param len Length of each input, in byte.
+ * @param count Number of inputs.
+ *
+ * @note The data written to the structure so far must be a multiple of SIZE_OF_SHA_256_CHUNK, this is meant for
+ * hashing many messages with a common prefix that has been calculated only once, like a keyed hash.
+ */
+void sha_256_close_multi(const struct Sha_256 *sha_256, uint8_t hash[][SIZE_OF_SHA_256_HASH], const void *const input[],
+                         size_t len, unsigned count);
+
 /**
  * @brief Initialize a SHA-256 streaming calculation.
  * @param sha_256 A pointer to a SHA-256 structure.
@@ -101,6 +155,17 @@ void sha_256_write(struct Sha_256 *sha_256, const void *data, size_t len);
  */
 uint8_t *sha_256_close(struct Sha_256 *sha_256);
 
+/**
+ * @brief Copy an on-going SHA-256 calculation.
+ * @param dst A pointer to the SHA-256 structure to copy to.
+ * @param src A pointer to the SHA-256 structure to copy from.
+ * @param hash Hash array, where the result of the copy will be delivered.
+ *
+ * @note Both calculations can then be continued independently. A structure must not be copied with a simple
+ * assignment, it contains a pointer into itself.
+ */
+void sha_256_copy(struct Sha_256 *dst, const struct Sha_256 *src, uint8_t hash[SIZE_OF_SHA_256_HASH]);
+
 #ifdef __cplusplus
 }
 #endif
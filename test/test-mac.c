@@ -0,0 +1,95 @@
+/**
+ * @file test-mac.c
+ * @brief checks of the keepalive authentication and its replay window
+ *
+ * The nonces are millisecond timestamps, so the replay window is run at
+ * a range of them: today, the nonce 1855425871872 (October 2028) from
+ * which on a window tagged with the truncated 32 bit block number took
+ * every fresh slot for a newer one, and a few far beyond. At each of them
+ * codes must verify once, replays and nonces that fell out of the window
+ * must be rejected, and the slots must be recycled as the nonces move on.
+ *
+ * Run it with `make check`, the exit status tells whether all passed.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mac.h"
+
+#define WINDOW 4096     // REPLAY_WINDOW of mac.c
+
+static unsigned failed = 0;
+
+static void check(bool ok, const char* what, uint64_t base, uint64_t nonce) {
+    if (!ok) {
+        printf("FAIL base %lu: %s, nonce %lu\n", base, what, nonce);
+        ++failed;
+    }
+}
+
+static void window_at(uint64_t base) {
+    mac_init("secret", 6);
+
+    // a keepalive verifies once, then it is a replay
+    mac_t mac = mac_gen(NULL, 0, base);
+    check(mac_nonce_fresh(base), "fresh before first use", base, base);
+    check(mac_test(NULL, 0, mac), "first use", base, base);
+    check(!mac_nonce_fresh(base), "fresh after use", base, base);
+    check(!mac_test(NULL, 0, mac), "replay", base, base);
+
+    // a wrong code does not use up the nonce
+    mac = mac_gen(NULL, 0, base + 1);
+    mac.hash[0] ^= 1;
+    check(!mac_test(NULL, 0, mac), "wrong code", base, base + 1);
+    mac.hash[0] ^= 1;
+    check(mac_test(NULL, 0, mac), "after wrong code", base, base + 1);
+
+    // the batched check of the outside agent agrees
+    mac_t macs[3] = {mac_gen(NULL, 0, base + 2), mac_gen(NULL, 0, base + 3), mac_gen(NULL, 0, base + 4)};
+    macs[1].hash[31] ^= 0x80;
+    bool valid[3];
+    mac_check_keepalives(macs, 3, valid);
+    check(valid[0] && !valid[1] && valid[2], "batched check", base, base + 2);
+
+    // nonces move on in steps that visit every slot several times, out of order inside
+    // the window: every nonce once, the ones the window has left behind never
+    uint64_t top = base + 1;
+    for (uint64_t n = base + 100; n < base + 40 * WINDOW; n += 37) {
+        check(mac_accept(n), "moving on", base, n);
+        check(mac_accept(n - 50), "out of order", base, n - 50);
+        check(!mac_accept(n - 50), "replay out of order", base, n - 50);
+        top = n;
+    }
+    check(!mac_nonce_fresh(top - WINDOW), "left the window", base, top - WINDOW);
+    check(!mac_accept(top - WINDOW), "left the window", base, top - WINDOW);
+    check(mac_accept(top - WINDOW + 1), "oldest in the window", base, top - WINDOW + 1);
+    check(!mac_accept(top), "replay of newest", base, top);
+
+    // a jump far ahead takes over the slots that still hold older blocks
+    uint64_t far = top + 1000 * WINDOW;
+    check(mac_accept(far), "jump ahead", base, far);
+    check(!mac_accept(top + 1), "behind the jump", base, top + 1);
+    check(mac_accept(far + 32 * 256), "same slot next round", base, far + 32 * 256);
+}
+
+int main(void) {
+    static const uint64_t bases[] = {
+        1790000000000ULL,       // 2026
+        1855425871872ULL - 5,   // right before the nonce whose truncated block is 2^31
+        1855425871872ULL,
+        1855425871872ULL + 123456789,
+        4294967296ULL * 32,     // truncated block number wrapping to 0
+        1ULL << 44,
+        1ULL << 47,
+    };
+    for (unsigned i = 0; i < sizeof(bases) / sizeof(bases[0]); ++i) {
+        unsigned before = failed;
+        window_at(bases[i]);
+        printf("nonces from %lu: %s\n", bases[i], (failed == before) ? "ok" : "FAILED");
+    }
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file test-sha-256.c
+ * @brief equivalence check of the SHA-256 implementations
+ *
+ * The portable scalar code is checked against known answers, then every
+ * implementation that sha_256_select() accepts on this CPU is checked
+ * against it, the scalar code included: calc_sha_256() for every length
+ * from 0 to 299 bytes, which covers all the ways the padding can fall
+ * into one or two chunks, and calc_sha_256_multi() with counts around
+ * the 8 lanes of the AVX2 kernel. Implementations the CPU lacks are
+ * reported as skipped.
+ *
+ * Run it with `make check`, the exit status tells whether all passed.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sha-256.h"
+
+#define MAX_LEN 300
+#define MAX_COUNT 17
+
+static unsigned failed = 0;
+
+static void check(bool ok, const char* impl, const char* what, size_t len, unsigned count) {
+    if (!ok) {
+        printf("FAIL %s: %s, length %zu, count %u\n", impl, what, len, count);
+        ++failed;
+    }
+}
+
+static void hex(uint8_t hash[SIZE_OF_SHA_256_HASH], char out[2 * SIZE_OF_SHA_256_HASH + 1]) {
+    for (unsigned i = 0; i < SIZE_OF_SHA_256_HASH; ++i) {
+        sprintf(out + 2 * i, "%02x", hash[i]);
+    }
+}
+
+/**
+ * the test vectors of FIPS 180-2, for the scalar reference itself
+ */
+static void known_answers(void) {
+    static const struct {
+        const char* input;
+        const char* hash;
+    } vectors[] = {
+        {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+        {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+        {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    };
+    sha_256_select(SHA_256_IMPL_SCALAR);
+    for (unsigned v = 0; v < sizeof(vectors) / sizeof(vectors[0]); ++v) {
+        uint8_t hash[SIZE_OF_SHA_256_HASH];
+        char text[2 * SIZE_OF_SHA_256_HASH + 1];
+        calc_sha_256(hash, vectors[v].input, strlen(vectors[v].input));
+        hex(hash, text);
+        check(strcmp(text, vectors[v].hash) == 0, "scalar", "known answer", strlen(vectors[v].input), 1);
+    }
+}
+
+int main(void) {
+    static uint8_t data[MAX_COUNT][MAX_LEN];
+    static uint8_t ref[MAX_LEN][MAX_COUNT][SIZE_OF_SHA_256_HASH];
+    static const enum sha_256_impl impls[] = {SHA_256_IMPL_SCALAR, SHA_256_IMPL_AVX2, SHA_256_IMPL_SHANI};
+    static const char* const names[] = {"scalar", "avx2", "sha-ni"};
+    const void* input[MAX_COUNT];
+
+    srand(1);
+    for (unsigned i = 0; i < MAX_COUNT; ++i) {
+        for (unsigned j = 0; j < MAX_LEN; ++j) {
+            data[i][j] = rand();
+        }
+        input[i] = data[i];
+    }
+
+    known_answers();
+    for (size_t len = 0; len < MAX_LEN; ++len) {
+        for (unsigned i = 0; i < MAX_COUNT; ++i) {
+            calc_sha_256(ref[len][i], data[i], len);
+        }
+    }
+
+    for (unsigned n = 0; n < sizeof(impls) / sizeof(impls[0]); ++n) {
+        if (sha_256_select(impls[n]) != impls[n]) {
+            printf("%s: skipped, not supported by this CPU\n", names[n]);
+            continue;
+        }
+        const char* name = names[n];
+        unsigned before = failed;
+        for (size_t len = 0; len < MAX_LEN; ++len) {
+            uint8_t hash[MAX_COUNT][SIZE_OF_SHA_256_HASH];
+            for (unsigned i = 0; i < MAX_COUNT; ++i) {
+                calc_sha_256(hash[i], data[i], len);
+                check(memcmp(hash[i], ref[len][i], SIZE_OF_SHA_256_HASH) == 0, name, "calc_sha_256", len, 1);
+            }
+            for (unsigned count = 1; count <= MAX_COUNT; ++count) {
+                calc_sha_256_multi(hash, input, len, count);
+                for (unsigned i = 0; i < count; ++i) {
+                    check(memcmp(hash[i], ref[len][i], SIZE_OF_SHA_256_HASH) == 0, name, "calc_sha_256_multi", len, count);
+                }
+            }
+        }
+        printf("%s: %s\n", name, (failed == before) ? "ok" : "FAILED");
+    }
+    sha_256_select(SHA_256_IMPL_AUTO);
+
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
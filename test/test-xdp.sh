@@ -0,0 +1,117 @@
+#!/bin/bash
+#
+# end-to-end test of the XDP fast path of the outside agent
+#
+# Puts the outside agent into a network namespace of its own, connected to
+# a second namespace by a pair of veth devices. The inside agent, an echo
+# service and the clients run in the second namespace, so every datagram
+# between the clients or the inside agent and the outside agent crosses
+# the veth device the XDP program is attached to. Each client sends
+# datagrams of varying size one after another and expects every one of
+# them echoed back unchanged. At the end the metrics of the outside agent
+# must show that most of them took the fast path, that is they were
+# counted as forwarded but never went through the agent itself.
+#
+# Needs root, iproute2 and python3. The program is attached in generic
+# mode, native XDP on veth needs a program on the peer as well and can't
+# complete the partial checksums of locally sent datagrams.
+#
+# usage: sudo test/test-xdp.sh [path to udp-tunnel] [clients] [datagrams per client]
+
+set -e
+
+BIN=$(realpath "${1:-./udp-tunnel}")
+CLIENTS=${2:-4}
+COUNT=${3:-200}
+NS_OUT=udpt-xdp-out
+NS_CL=udpt-xdp-cl
+TMP=$(mktemp -d)
+
+cleanup() {
+    pkill -P $$ 2>/dev/null || true
+    ip netns del $NS_OUT 2>/dev/null || true
+    ip netns del $NS_CL 2>/dev/null || true
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+ip netns add $NS_OUT
+ip netns add $NS_CL
+ip link add veth-out netns $NS_OUT type veth peer name veth-cl netns $NS_CL
+ip -n $NS_OUT addr add 10.99.0.1/24 dev veth-out
+ip -n $NS_CL addr add 10.99.0.2/24 dev veth-cl
+for ns in $NS_OUT $NS_CL; do
+    ip -n $ns link set lo up
+done
+ip -n $NS_OUT link set veth-out up
+ip -n $NS_CL link set veth-cl up
+
+ip netns exec $NS_OUT "$BIN" -l 47001 -k test -t 1 --xdp veth-out --xdp-generic --metrics "$TMP/metrics.sock" > "$TMP/outside.log" 2>&1 &
+sleep 0.5
+
+result=0
+ip netns exec $NS_CL python3 - "$BIN" "$CLIENTS" "$COUNT" "$TMP" <<'EOF' || result=$?
+import socket, subprocess, sys, threading, time
+
+binary, clients, count, tmp = sys.argv[1], int(sys.argv[2]), int(sys.argv[3]), sys.argv[4]
+
+echo = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+echo.bind(("127.0.0.1", 47000))
+def serve():
+    while True:
+        data, addr = echo.recvfrom(65535)
+        echo.sendto(data, addr)
+threading.Thread(target=serve, daemon=True).start()
+
+inside = subprocess.Popen([binary, "-s", "127.0.0.1:47000", "-o", "10.99.0.1:47001", "-k", "test", "-t", "1", "--spares", str(clients)],
+    stdout=open(tmp + "/inside.log", "w"), stderr=subprocess.STDOUT)
+time.sleep(1.5)
+
+failed = False
+for c in range(clients):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(0.5)
+    echoed = 0
+    for i in range(count):
+        msg = f"client {c} datagram {i} ".encode() * (1 + i % 50)
+        s.sendto(msg, ("10.99.0.1", 47001))
+        try:
+            if s.recvfrom(65535)[0] == msg:
+                echoed += 1
+        except socket.timeout:
+            pass
+    print(f"client {c}: {echoed} of {count} echoed")
+    # the first datagram of a client may get lost while its tunnel is handed over
+    failed = failed or (echoed < count - 1)
+inside.terminate()
+sys.exit(1 if failed else 0)
+EOF
+
+# wait for the counters of the program to be collected
+sleep 1.5
+metrics=$(ip netns exec $NS_OUT python3 -c "
+import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.settimeout(1)
+out = b''
+try:
+    while True:
+        d = s.recv(65536)
+        if not d:
+            break
+        out += d
+except socket.timeout:
+    pass
+print(out.decode())
+" "$TMP/metrics.sock")
+
+forwarded=$(echo "$metrics" | awk '/^udp_tunnel_packets_total\{direction="up"\}/ { print $2 }')
+agent=$(echo "$metrics" | awk '/^udp_tunnel_forward_latency_seconds_count\{direction="up"\}/ { print $2 }')
+echo "towards the service: $forwarded datagrams forwarded, $agent of them by the agent itself"
+
+if [ "$result" -ne 0 ] || [ -z "$forwarded" ] || [ "$forwarded" -lt $((CLIENTS * (COUNT - 1))) ] || [ $((agent * 10)) -gt "$forwarded" ]; then
+    echo FAIL
+    exit 1
+fi
+echo PASS
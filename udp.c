@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include "udp.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/udp.h>
+
+#include "misc.h"
+
+/**
+ * Helpers for UDP generic segmentation and receive offload. With UDP_GRO
+ * enabled the kernel may hand us a train of consecutive same sized
+ * datagrams from the same source as one big buffer, together with the size
+ * of the individual segments. Such a train can be sent on in one piece
+ * with UDP_SEGMENT set to the same size, the kernel (or the NIC) splits it
+ * up again, so the datagrams on the wire stay exactly the same.
+ */
+
+/**
+ * enable receive offload on a socket. Failure is logged but not fatal,
+ * the socket will then simply keep receiving single datagrams.
+ */
+void udp_enable_gro(int sock) {
+    int one = 1;
+    if (setsockopt(sock, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+        print_e(LOG_WARN, "could not enable UDP_GRO");
+    }
+}
+
+/**
+ * return the segment size of a received train or 0 if the message
+ * contains only a single datagram.
+ */
+uint16_t udp_gro_size(struct msghdr* msg) {
+    if (msg->msg_controllen == 0) {
+        return 0;
+    }
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+        if ((c->cmsg_level == IPPROTO_UDP) && (c->cmsg_type == UDP_GRO)) {
+            int seg;
+            memcpy(&seg, CMSG_DATA(c), sizeof(seg));
+            return seg;
+        }
+    }
+    return 0;
+}
+
+/**
+ * let the kernel attach the time of arrival to every received datagram.
+ * Failure is logged but not fatal, the callers then fall back to the
+ * time they woke up.
+ */
+void udp_enable_timestamps(int sock) {
+    int one = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0) {
+        print_e(LOG_WARN, "could not enable SO_TIMESTAMPNS");
+    }
+}
+
+/**
+ * return the kernel receive timestamp of a message in nanoseconds of the
+ * realtime clock, or 0 if it has none.
+ */
+uint64_t udp_rx_time(struct msghdr* msg) {
+    if (msg->msg_controllen == 0) {
+        return 0;
+    }
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+        if ((c->cmsg_level == SOL_SOCKET) && (c->cmsg_type == SCM_TIMESTAMPNS)) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+
+/**
+ * prepare an outgoing message to be split into segments of the given
+ * size, or clear its control data if it is only a single datagram.
+ *
+ * @param msg message to be sent
+ * @param ctrl buffer of UDP_CTRL_SIZE bytes that lives as long as msg
+ * @param seg segment size or 0
+ * @param len total length of the payload
+ */
+void udp_set_gso_size(struct msghdr* msg, char* ctrl, uint16_t seg, size_t len) {
+    if ((seg == 0) || (seg >= len)) {
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+        return;
+    }
+    memset(ctrl, 0, UDP_CTRL_SIZE);
+    msg->msg_control = ctrl;
+    msg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+    struct cmsghdr* c = CMSG_FIRSTHDR(msg);
+    c->cmsg_level = IPPROTO_UDP;
+    c->cmsg_type = UDP_SEGMENT;
+    c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(c), &seg, sizeof(seg));
+}
+
+/**
+ * fallback for when the kernel refuses to segment a train (for example
+ * because the outgoing device has no checksum offload): send the segments
+ * one by one.
+ */
+static void send_segments(int sock, struct msghdr* msg) {
+    uint16_t seg;
+    memcpy(&seg, CMSG_DATA(CMSG_FIRSTHDR(msg)), sizeof(seg));
+    const char* p = msg->msg_iov[0].iov_base;
+    size_t left = msg->msg_iov[0].iov_len;
+    while (left) {
+        size_t n = (left < seg) ? left : seg;
+        sendto(sock, p, n, 0, msg->msg_name, msg->msg_namelen);
+        p += n;
+        left -= n;
+    }
+}
+
+/**
+ * send a batch of prepared datagrams or trains, if one of them fails it
+ * will be skipped and sending continues with the next one. A train that
+ * the kernel refused to segment is sent segment by segment instead.
+ * Afterwards msg_len of every message holds the number of bytes sent,
+ * 0 if it failed.
+ *
+ * @return number of datagrams that could not be sent
+ */
+unsigned udp_send_batch(int sock, struct mmsghdr* msgs, unsigned count) {
+    unsigned sent = 0;
+    unsigned failed = 0;
+    while (sent < count) {
+        int n = sendmmsg(sock, msgs + sent, count - sent, 0);
+        if (n < 0) {
+            if (msgs[sent].msg_hdr.msg_controllen) {
+                send_segments(sock, &msgs[sent].msg_hdr);
+                msgs[sent].msg_len = msgs[sent].msg_hdr.msg_iov[0].iov_len;
+            } else {
+                msgs[sent].msg_len = 0;
+                ++failed;
+            }
+            ++sent;
+        } else {
+            sent += n;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,20 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// room for one UDP_GRO or UDP_SEGMENT control message and a receive timestamp
+#define UDP_CTRL_SIZE 64
+
+void udp_enable_gro(int sock);
+uint16_t udp_gro_size(struct msghdr* msg);
+void udp_enable_timestamps(int sock);
+uint64_t udp_rx_time(struct msghdr* msg);
+void udp_set_gso_size(struct msghdr* msg, char* ctrl, uint16_t seg, size_t len);
+unsigned udp_send_batch(int sock, struct mmsghdr* msgs, unsigned count);
+
+#endif
@@ -0,0 +1,225 @@
+#include "uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * create the ring and map its queues into our address space.
+ *
+ * @param r pointer to the uninitialized ring structure
+ * @param entries number of submission queue entries
+ * @param sqpoll_idle_ms let a kernel thread poll the submission queue, it
+ *        goes to sleep after this long without work, 0 for no thread
+ * @return true on success, errno is set otherwise
+ */
+bool uring_init(uring_t* r, unsigned entries, unsigned sqpoll_idle_ms) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(uring_t));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    if (sqpoll_idle_ms) {
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = sqpoll_idle_ms;
+        r->sqpoll = true;
+    }
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return false;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (sq_len < cq_len) {
+        sq_len = cq_len;  // with IORING_FEAT_SINGLE_MMAP both rings share one mapping
+    }
+    char* sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(r->fd);
+        return false;
+    }
+    char* cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            close(r->fd);
+            return false;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return false;
+    }
+
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_flags = (unsigned*)(sq + p.sq_off.flags);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->sqe_tail = *r->sq_tail;
+    return true;
+}
+
+/**
+ * get a cleared submission queue entry to fill in. It will be submitted
+ * with the next call to uring_submit_and_wait(). If the queue is full the
+ * pending entries are submitted first.
+ *
+ * @return pointer to the entry
+ */
+struct io_uring_sqe* uring_get_sqe(uring_t* r) {
+    if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        uring_submit_and_wait(r, 0, -1);
+    }
+    unsigned idx = r->sqe_tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    ++r->sqe_tail;
+    ++r->sq_pending;
+    return sqe;
+}
+
+/**
+ * make the entry filled in after this one wait until this one completed,
+ * whatever its result. Does nothing if the entry was already submitted,
+ * which only happens when the queue ran full in between.
+ *
+ * @param sqe entry returned by uring_get_sqe()
+ */
+void uring_link(uring_t* r, struct io_uring_sqe* sqe) {
+    unsigned submitted = *r->sq_tail;
+    if ((((unsigned)(sqe - r->sqes) - submitted) & r->sq_mask) < r->sqe_tail - submitted) {
+        sqe->flags |= IOSQE_IO_HARDLINK;
+    }
+}
+
+/**
+ * submit all pending entries and optionally wait for completions, both in
+ * one single system call. With a polling kernel thread submitting needs no
+ * system call at all, unless the thread went to sleep and must be woken.
+ *
+ * @param wait_nr number of completions to wait for, 0 to only submit
+ * @param timeout_ms give up waiting after this time, negative waits forever
+ * @return number of submitted entries or negative on error (errno is set)
+ */
+int uring_submit_and_wait(uring_t* r, unsigned wait_nr, int timeout_ms) {
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    unsigned to_submit = r->sq_pending;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    if (r->sqpoll) {
+        // the kernel thread takes them from here, the tail must be visible before we look at its flags
+        r->sq_pending = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+            flags |= IORING_ENTER_SQ_WAIT;
+        }
+        if (flags == 0) {
+            return to_submit;
+        }
+    }
+
+    struct __kernel_timespec ts = {0};
+    struct io_uring_getevents_arg arg = {0};
+    void* argp = NULL;
+    size_t argsz = 0;
+    if (wait_nr && (timeout_ms >= 0)) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = (uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    int ret = syscall(__NR_io_uring_enter, r->fd, r->sqpoll ? 0 : to_submit, wait_nr, flags, argp, argsz);
+    if (r->sqpoll) {
+        return (ret < 0) ? ret : (int)to_submit;
+    }
+    if (ret >= 0) {
+        r->sq_pending -= ret;
+    }
+    return ret;
+}
+
+/**
+ * return the next completion or NULL if there is none yet. It must be
+ * released with uring_cqe_seen() after it has been processed.
+ */
+struct io_uring_cqe* uring_peek_cqe(uring_t* r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(uring_t* r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * allocate a ring of provided buffers, register it with the kernel as
+ * buffer group bgid and hand all buffers to the kernel.
+ *
+ * @param entries number of buffers, must be a power of 2
+ * @param buf_size size of each buffer
+ * @return true on success, errno is set otherwise
+ */
+bool uring_bufs_init(uring_t* r, uring_bufs_t* b, uint16_t bgid, unsigned entries, size_t buf_size) {
+    size_t ring_len = entries * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (b->ring == MAP_FAILED) {
+        return false;
+    }
+    b->data = malloc(entries * buf_size);
+    if (b->data == NULL) {
+        return false;
+    }
+    b->buf_size = buf_size;
+    b->entries = entries;
+    b->bgid = bgid;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)b->ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+    b->ring->tail = 0;
+    for (unsigned i = 0; i < entries; ++i) {
+        uring_bufs_put(b, i);
+    }
+    return true;
+}
+
+/**
+ * return the address of a buffer selected by the kernel
+ */
+char* uring_bufs_get(uring_bufs_t* b, uint16_t bid) {
+    return b->data + (size_t)bid * b->buf_size;
+}
+
+/**
+ * give a buffer back to the kernel after we are done with its content
+ */
+void uring_bufs_put(uring_bufs_t* b, uint16_t bid) {
+    uint16_t tail = b->ring->tail;
+    struct io_uring_buf* buf = &b->ring->bufs[tail & (b->entries - 1)];
+    buf->addr = (uintptr_t)uring_bufs_get(b, bid);
+    buf->len = b->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&b->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
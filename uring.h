@@ -0,0 +1,52 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/**
+ * minimal io_uring wrapper on top of the raw system calls, just enough
+ * for the datapath: one submission and completion queue, and rings of
+ * provided buffers for multishot receive. Entries are filled in behind
+ * the back of the kernel and handed over all at once on submission, with
+ * a kernel thread polling the submission queue that needs no system call.
+ */
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_flags;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending;
+    unsigned sqe_tail;          // entries up to here are filled in, the kernel sees them up to *sq_tail
+    bool sqpoll;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+} uring_t;
+
+typedef struct {
+    struct io_uring_buf_ring* ring;
+    char* data;
+    size_t buf_size;
+    unsigned entries;
+    uint16_t bgid;
+} uring_bufs_t;
+
+bool uring_init(uring_t* r, unsigned entries, unsigned sqpoll_idle_ms);
+struct io_uring_sqe* uring_get_sqe(uring_t* r);
+void uring_link(uring_t* r, struct io_uring_sqe* sqe);
+int uring_submit_and_wait(uring_t* r, unsigned wait_nr, int timeout_ms);
+struct io_uring_cqe* uring_peek_cqe(uring_t* r);
+void uring_cqe_seen(uring_t* r);
+bool uring_bufs_init(uring_t* r, uring_bufs_t* b, uint16_t bgid, unsigned entries, size_t buf_size);
+char* uring_bufs_get(uring_bufs_t* b, uint16_t bid);
+void uring_bufs_put(uring_bufs_t* b, uint16_t bid);
+
+#endif
@@ -0,0 +1,179 @@
+#include "wheel.h"
+
+#include <string.h>
+
+#define LEVEL_SHIFT(l)  ((l) * WHEEL_BITS)
+#define SLOT_MASK       (WHEEL_SLOTS - 1)
+#define MAX_DELTA       ((1ULL << LEVEL_SHIFT(WHEEL_LEVELS)) - 1)
+
+void wheel_init(timer_wheel_t* w, uint64_t now) {
+    memset(w, 0, sizeof(timer_wheel_t));
+    w->now = now;
+}
+
+void wheel_timer_init(wheel_timer_t* t, wheel_fn_t fn) {
+    memset(t, 0, sizeof(wheel_timer_t));
+    t->fn = fn;
+}
+
+static void link_timer(timer_wheel_t* w, wheel_timer_t* t) {
+    uint64_t expires = t->expires;
+    if (expires < w->now) {
+        expires = w->now;  // overdue, will fire with the next tick
+    }
+    uint64_t delta = expires - w->now;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expires = w->now + delta;
+    }
+    unsigned level = 0;
+    while ((level < WHEEL_LEVELS - 1) && (delta >= (1ULL << LEVEL_SHIFT(level + 1)))) {
+        ++level;
+    }
+    unsigned slot = (expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    wheel_timer_t** head = &w->slots[level][slot];
+    t->next = *head;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = head;
+    *head = t;
+    t->level = level;
+    t->slot = slot;
+    w->occupied[level] |= 1ULL << slot;
+}
+
+/**
+ * schedule a timer, if it is already pending it will be rescheduled.
+ *
+ * @param w the wheel
+ * @param t the timer
+ * @param expires absolute time in milliseconds
+ */
+void wheel_add(timer_wheel_t* w, wheel_timer_t* t, uint64_t expires) {
+    wheel_del(t);
+    t->wheel = w;
+    t->expires = expires;
+    link_timer(w, t);
+}
+
+/**
+ * cancel a timer, does nothing if it is not pending.
+ */
+void wheel_del(wheel_timer_t* t) {
+    if (t->pprev == NULL) {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+    timer_wheel_t* w = t->wheel;
+    if (w->slots[t->level][t->slot] == NULL) {
+        w->occupied[t->level] &= ~(1ULL << t->slot);
+    }
+}
+
+/**
+ * take all timers out of one slot and put them back in, relative to the
+ * current time they now end up in a lower level.
+ *
+ * @return index of the slot in its level
+ */
+static unsigned cascade(timer_wheel_t* w, unsigned level) {
+    unsigned slot = (w->now >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    wheel_timer_t* t = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~(1ULL << slot);
+    while (t) {
+        wheel_timer_t* next = t->next;
+        link_timer(w, t);
+        t = next;
+    }
+    return slot;
+}
+
+/**
+ * move the wheel forward and fire all timers that expired until now.
+ * The callbacks may add and delete any timers, including other timers
+ * that are due in the same tick.
+ *
+ * @param w the wheel
+ * @param now current time in milliseconds
+ */
+void wheel_advance(timer_wheel_t* w, uint64_t now) {
+    while (w->now <= now) {
+        uint64_t tick = w->now;
+        unsigned slot = tick & SLOT_MASK;
+
+        // nothing to fire in level 0, skip ahead to the next cascade
+        if ((w->occupied[0] == 0) && (slot != 0)) {
+            uint64_t next = (tick | SLOT_MASK) + 1;
+            w->now = (next < now + 1) ? next : now + 1;
+            continue;
+        }
+
+        if (slot == 0) {
+            for (unsigned level = 1; level < WHEEL_LEVELS; ++level) {
+                if (cascade(w, level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        // detach the whole slot first, timers added by the callbacks will
+        // go into later slots because the wheel has already moved on
+        wheel_timer_t* pending = w->slots[0][slot];
+        w->slots[0][slot] = NULL;
+        w->occupied[0] &= ~(1ULL << slot);
+        if (pending) {
+            pending->pprev = &pending;
+        }
+        w->now = tick + 1;
+        while (pending) {
+            wheel_timer_t* t = pending;
+            wheel_del(t);
+            t->fn(t);
+        }
+    }
+}
+
+/**
+ * the time to sleep until the next timer is due. For timers in the upper
+ * levels this is the time of their cascade, which is never later than
+ * their expiry.
+ *
+ * @param w the wheel
+ * @param now current time in milliseconds
+ * @return milliseconds or -1 if no timer is pending
+ */
+int wheel_timeout(timer_wheel_t* w, uint64_t now) {
+    uint64_t first = UINT64_MAX;
+    for (unsigned level = 0; level < WHEEL_LEVELS; ++level) {
+        uint64_t bits = w->occupied[level];
+        if (bits == 0) {
+            continue;
+        }
+        uint64_t index = w->now >> LEVEL_SHIFT(level);
+        unsigned pos = index & SLOT_MASK;
+        uint64_t rotated = (bits >> pos) | (pos ? bits << (WHEEL_SLOTS - pos) : 0);
+        unsigned k = __builtin_ctzll(rotated);
+        if ((level > 0) && (k == 0) && ((index << LEVEL_SHIFT(level)) != w->now)) {
+            k = WHEEL_SLOTS;  // the current slot of an upper level was already cascaded, next turn
+        }
+        uint64_t tick = (index + k) << LEVEL_SHIFT(level);
+        if (tick < first) {
+            first = tick;
+        }
+    }
+    if (first == UINT64_MAX) {
+        return -1;
+    }
+    if (first <= now) {
+        return 0;
+    }
+    uint64_t delta = first - now;
+    return (delta > 0x7fffffff) ? 0x7fffffff : (int)delta;
+}
@@ -0,0 +1,49 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_LEVELS    4
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+
+#define container_of(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+typedef struct wheel_timer wheel_timer_t;
+typedef struct timer_wheel timer_wheel_t;
+typedef void (*wheel_fn_t)(wheel_timer_t* timer);
+
+/**
+ * a timer is embedded into the structure it belongs to, the callback
+ * uses container_of() to get from the timer back to its owner.
+ */
+struct wheel_timer {
+    wheel_timer_t* next;
+    wheel_timer_t** pprev;      // NULL when the timer is not pending
+    timer_wheel_t* wheel;
+    uint64_t expires;
+    wheel_fn_t fn;
+    uint8_t level;
+    uint8_t slot;
+};
+
+/**
+ * hierarchical timer wheel with millisecond ticks. Level n has 64 slots
+ * of 64^n ticks each, timers in the upper levels are cascaded down as
+ * time moves on, so adding and removing a timer is O(1).
+ */
+struct timer_wheel {
+    uint64_t now;               // next tick to be processed
+    uint64_t occupied[WHEEL_LEVELS];
+    wheel_timer_t* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void wheel_init(timer_wheel_t* w, uint64_t now);
+void wheel_timer_init(wheel_timer_t* t, wheel_fn_t fn);
+void wheel_add(timer_wheel_t* w, wheel_timer_t* t, uint64_t expires);
+void wheel_del(wheel_timer_t* t);
+void wheel_advance(timer_wheel_t* w, uint64_t now);
+int wheel_timeout(timer_wheel_t* w, uint64_t now);
+
+#endif
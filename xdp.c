@@ -0,0 +1,378 @@
+#include "xdp.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+
+#include "mac.h"
+#include "misc.h"
+
+/**
+ * The XDP program forwards the datagrams of established flows on the
+ * outside without them ever reaching the socket. For every flow the map
+ * holds two entries, one keyed by the client address pointing to the
+ * tunnel and one the other way round. A datagram from a known address to
+ * our port gets its addresses and ports rewritten as if we had sent it
+ * from our socket and is bounced out of the interface it came in on.
+ * Everything else, including anything keepalive sized, is passed on to
+ * the regular receive path.
+ *
+ * There is no compiler for BPF at hand, the program is assembled from
+ * instructions right here, in the spirit of the classic BPF steering
+ * program, and loaded with the raw bpf() system call.
+ */
+typedef struct {
+    uint32_t addr;      // network byte order, like in struct sockaddr_in
+    uint16_t port;
+    uint16_t pad;
+} flow_key_t;
+
+typedef struct {
+    uint32_t addr;      // where to send it
+    uint16_t port;
+    uint16_t pad;
+    uint64_t packets;   // counted by the program
+    uint64_t bytes;
+} flow_value_t;
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define ALU_IMM(op, d, i)       INSN(BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+#define ALU_REG(op, d, s)       INSN(BPF_ALU64 | (op) | BPF_X, d, s, 0, 0)
+#define MOV_IMM(d, i)           ALU_IMM(BPF_MOV, d, i)
+#define MOV_REG(d, s)           ALU_REG(BPF_MOV, d, s)
+#define LDX(size, d, s, o)      INSN(BPF_LDX | BPF_MEM | (size), d, s, o, 0)
+#define STX(size, d, s, o)      INSN(BPF_STX | BPF_MEM | (size), d, s, o, 0)
+#define ST(size, d, o, i)       INSN(BPF_ST | BPF_MEM | (size), d, 0, o, i)
+#define JMP_IMM(op, d, i, o)    INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define JMP_REG(op, d, s, o)    INSN(BPF_JMP | (op) | BPF_X, d, s, o, 0)
+#define ATOMIC_ADD(d, s, o)     INSN(BPF_STX | BPF_ATOMIC | BPF_DW, d, s, o, BPF_ADD)
+#define TO_HOST16(d)            INSN(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define LD_MAP_FD(d, fd)        INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+#define CALL(f)                 INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()                  INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+// fold the carries of a ones' complement sum back into the lower 16 bits
+#define FOLD(r)                 MOV_REG(BPF_REG_0, r), ALU_IMM(BPF_RSH, BPF_REG_0, 16), ALU_IMM(BPF_AND, r, 0xffff), ALU_REG(BPF_ADD, r, BPF_REG_0)
+#define IP_WORD(o)              LDX(BPF_H, BPF_REG_0, BPF_REG_8, OFF_IP + (o)), ALU_REG(BPF_ADD, BPF_REG_9, BPF_REG_0)
+
+// jump offset placeholder, resolved to the XDP_PASS exit at the end of the program
+#define PASS 0x7fff
+
+#define OFF_ETH_TYPE    12
+#define OFF_IP          14
+#define OFF_IP_FRAG     (OFF_IP + 6)
+#define OFF_IP_TTL      (OFF_IP + 8)
+#define OFF_IP_PROTO    (OFF_IP + 9)
+#define OFF_IP_CSUM     (OFF_IP + 10)
+#define OFF_IP_SRC      (OFF_IP + 12)
+#define OFF_IP_DST      (OFF_IP + 16)
+#define OFF_UDP         (OFF_IP + 20)
+#define OFF_UDP_SRC     (OFF_UDP + 0)
+#define OFF_UDP_DST     (OFF_UDP + 2)
+#define OFF_UDP_LEN     (OFF_UDP + 4)
+#define OFF_UDP_CSUM    (OFF_UDP + 6)
+#define HDR_LEN         (OFF_UDP + 8)
+
+static int map_fd = -1;
+static int link_fd = -1;
+static unsigned map_size;
+static flow_key_t* keys;
+static flow_value_t* values;
+static xdp_flow_t* flows;
+
+static int bpf(int cmd, union bpf_attr* attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int load_program(uint16_t port) {
+    struct bpf_insn prog[] = {
+        MOV_REG(BPF_REG_6, BPF_REG_1),
+        LDX(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data)),
+        LDX(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end)),
+        MOV_REG(BPF_REG_4, BPF_REG_2),
+        ALU_IMM(BPF_ADD, BPF_REG_4, HDR_LEN),
+        JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, PASS),
+        MOV_REG(BPF_REG_8, BPF_REG_2),
+
+        // only IPv4 without options and not fragmented, UDP to our port and not keepalive sized
+        LDX(BPF_H, BPF_REG_0, BPF_REG_8, OFF_ETH_TYPE),
+        JMP_IMM(BPF_JNE, BPF_REG_0, htons(ETH_P_IP), PASS),
+        LDX(BPF_B, BPF_REG_0, BPF_REG_8, OFF_IP),
+        JMP_IMM(BPF_JNE, BPF_REG_0, 0x45, PASS),
+        LDX(BPF_H, BPF_REG_0, BPF_REG_8, OFF_IP_FRAG),
+        ALU_IMM(BPF_AND, BPF_REG_0, htons(0x3fff)),
+        JMP_IMM(BPF_JNE, BPF_REG_0, 0, PASS),
+        LDX(BPF_B, BPF_REG_0, BPF_REG_8, OFF_IP_PROTO),
+        JMP_IMM(BPF_JNE, BPF_REG_0, IPPROTO_UDP, PASS),
+        LDX(BPF_H, BPF_REG_0, BPF_REG_8, OFF_UDP_DST),
+        JMP_IMM(BPF_JNE, BPF_REG_0, htons(port), PASS),
+        LDX(BPF_H, BPF_REG_0, BPF_REG_8, OFF_UDP_LEN),
+        TO_HOST16(BPF_REG_0),
+        JMP_IMM(BPF_JEQ, BPF_REG_0, 8 + sizeof(mac_t), PASS),
+        JMP_IMM(BPF_JLT, BPF_REG_0, 8, PASS),
+
+        // look up the source address
+        LDX(BPF_W, BPF_REG_0, BPF_REG_8, OFF_IP_SRC),
+        STX(BPF_W, BPF_REG_10, BPF_REG_0, -8),
+        LDX(BPF_H, BPF_REG_0, BPF_REG_8, OFF_UDP_SRC),
+        STX(BPF_H, BPF_REG_10, BPF_REG_0, -4),
+        ST(BPF_H, BPF_REG_10, -2, 0),
+        LD_MAP_FD(BPF_REG_1, map_fd),
+        MOV_REG(BPF_REG_2, BPF_REG_10),
+        ALU_IMM(BPF_ADD, BPF_REG_2, -8),
+        CALL(BPF_FUNC_map_lookup_elem),
+        JMP_IMM(BPF_JEQ, BPF_REG_0, 0, PASS),
+        MOV_REG(BPF_REG_7, BPF_REG_0),
+
+        // it now comes from our address and port and goes to the other end of the flow
+        LDX(BPF_W, BPF_REG_1, BPF_REG_8, OFF_IP_SRC),
+        LDX(BPF_W, BPF_REG_2, BPF_REG_8, OFF_IP_DST),
+        LDX(BPF_W, BPF_REG_3, BPF_REG_7, offsetof(flow_value_t, addr)),
+        STX(BPF_W, BPF_REG_8, BPF_REG_2, OFF_IP_SRC),
+        STX(BPF_W, BPF_REG_8, BPF_REG_3, OFF_IP_DST),
+        LDX(BPF_H, BPF_REG_4, BPF_REG_8, OFF_UDP_SRC),
+        LDX(BPF_H, BPF_REG_2, BPF_REG_8, OFF_UDP_DST),
+        LDX(BPF_H, BPF_REG_5, BPF_REG_7, offsetof(flow_value_t, port)),
+        STX(BPF_H, BPF_REG_8, BPF_REG_2, OFF_UDP_SRC),
+        STX(BPF_H, BPF_REG_8, BPF_REG_5, OFF_UDP_DST),
+
+        // Our own address and port only moved within the pseudo header, so the UDP checksum
+        // changes by the old source address and port going out and the new destination
+        // coming in (RFC 1624). The sum is the same in either byte order, no need to swap.
+        LDX(BPF_H, BPF_REG_2, BPF_REG_8, OFF_UDP_CSUM),
+        MOV_REG(BPF_REG_9, BPF_REG_2),
+        ALU_IMM(BPF_XOR, BPF_REG_9, 0xffff),
+        MOV_REG(BPF_REG_0, BPF_REG_1),
+        ALU_IMM(BPF_AND, BPF_REG_0, 0xffff),
+        ALU_IMM(BPF_XOR, BPF_REG_0, 0xffff),
+        ALU_REG(BPF_ADD, BPF_REG_9, BPF_REG_0),
+        ALU_IMM(BPF_RSH, BPF_REG_1, 16),
+        ALU_IMM(BPF_XOR, BPF_REG_1, 0xffff),
+        ALU_REG(BPF_ADD, BPF_REG_9, BPF_REG_1),
+        ALU_IMM(BPF_XOR, BPF_REG_4, 0xffff),
+        ALU_REG(BPF_ADD, BPF_REG_9, BPF_REG_4),
+        MOV_REG(BPF_REG_0, BPF_REG_3),
+        ALU_IMM(BPF_AND, BPF_REG_0, 0xffff),
+        ALU_REG(BPF_ADD, BPF_REG_9, BPF_REG_0),
+        ALU_IMM(BPF_RSH, BPF_REG_3, 16),
+        ALU_REG(BPF_ADD, BPF_REG_9, BPF_REG_3),
+        ALU_REG(BPF_ADD, BPF_REG_9, BPF_REG_5),
+        FOLD(BPF_REG_9),
+        FOLD(BPF_REG_9),
+        ALU_IMM(BPF_XOR, BPF_REG_9, 0xffff),
+        JMP_IMM(BPF_JNE, BPF_REG_9, 0, 1),      // a computed 0 is sent as all ones
+        MOV_IMM(BPF_REG_9, 0xffff),
+        JMP_IMM(BPF_JNE, BPF_REG_2, 0, 1),      // and a datagram without checksum stays without
+        MOV_IMM(BPF_REG_9, 0),
+        STX(BPF_H, BPF_REG_8, BPF_REG_9, OFF_UDP_CSUM),
+
+        // a fresh TTL like our socket would use, the header checksum is simply recalculated
+        ST(BPF_B, BPF_REG_8, OFF_IP_TTL, 64),
+        ST(BPF_H, BPF_REG_8, OFF_IP_CSUM, 0),
+        MOV_IMM(BPF_REG_9, 0),
+        IP_WORD(0), IP_WORD(2), IP_WORD(4), IP_WORD(6), IP_WORD(8),
+        IP_WORD(10), IP_WORD(12), IP_WORD(14), IP_WORD(16), IP_WORD(18),
+        FOLD(BPF_REG_9),
+        FOLD(BPF_REG_9),
+        ALU_IMM(BPF_XOR, BPF_REG_9, 0xffff),
+        STX(BPF_H, BPF_REG_8, BPF_REG_9, OFF_IP_CSUM),
+
+        // back to where it came from on the link layer, that is our router. This assumes that
+        // clients and the inside agent are both reached through the same next hop, like on a
+        // host with a single default route. If one of them is on the local segment or behind
+        // another router the datagram goes to the wrong one, --xdp must not be used there.
+        LDX(BPF_W, BPF_REG_0, BPF_REG_8, 0),
+        LDX(BPF_H, BPF_REG_1, BPF_REG_8, 4),
+        LDX(BPF_W, BPF_REG_2, BPF_REG_8, 6),
+        LDX(BPF_H, BPF_REG_3, BPF_REG_8, 10),
+        STX(BPF_W, BPF_REG_8, BPF_REG_2, 0),
+        STX(BPF_H, BPF_REG_8, BPF_REG_3, 4),
+        STX(BPF_W, BPF_REG_8, BPF_REG_0, 6),
+        STX(BPF_H, BPF_REG_8, BPF_REG_1, 10),
+
+        LDX(BPF_H, BPF_REG_0, BPF_REG_8, OFF_UDP_LEN),
+        TO_HOST16(BPF_REG_0),
+        ALU_IMM(BPF_ADD, BPF_REG_0, -8),
+        MOV_IMM(BPF_REG_1, 1),
+        ATOMIC_ADD(BPF_REG_7, BPF_REG_1, offsetof(flow_value_t, packets)),
+        ATOMIC_ADD(BPF_REG_7, BPF_REG_0, offsetof(flow_value_t, bytes)),
+        MOV_IMM(BPF_REG_0, XDP_TX),
+        EXIT(),
+
+        MOV_IMM(BPF_REG_0, XDP_PASS),
+        EXIT()
+    };
+    unsigned len = sizeof(prog) / sizeof(prog[0]);
+    for (unsigned i = 0; i < len; ++i) {
+        if ((BPF_CLASS(prog[i].code) == BPF_JMP) && (prog[i].off == PASS)) {
+            prog[i].off = len - 2 - (i + 1);
+        }
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uintptr_t)prog;
+    attr.insn_cnt = len;
+    attr.license = (uintptr_t)"GPL";
+    strncpy(attr.prog_name, "udp_tunnel", sizeof(attr.prog_name) - 1);
+    int fd = bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+        // once more for the log of the verifier, the last lines tell what it did not like
+        int err = errno;
+        static char log[65536];
+        attr.log_buf = (uintptr_t)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+        if (bpf(BPF_PROG_LOAD, &attr) < 0) {
+            // a log line holds less than the whole log, print its last lines one by one
+            char* start = log + strlen(log);
+            for (int lines = 0; start > log && lines < 6; lines += *--start == '\n') {}
+            for (char* line = strtok(start, "\n"); line; line = strtok(NULL, "\n")) {
+                print(LOG_DEBUG, "BPF verifier: %s", line);
+            }
+        }
+        errno = err;
+    }
+    return fd;
+}
+
+/**
+ * create the flow map, load the program and attach it to an interface.
+ * The program stays attached as long as we are running.
+ *
+ * @param ifname interface the datagrams of the clients and tunnels arrive on
+ * @param port our listen port
+ * @param max_flows size of the map, every flow takes two entries
+ * @param generic use the generic XDP mode even if the driver supports XDP
+ * @return true on success, errno is set otherwise
+ */
+bool xdp_attach(const char* ifname, uint16_t port, unsigned max_flows, bool generic) {
+    unsigned ifindex = if_nametoindex(ifname);
+    if (ifindex == 0) {
+        return false;
+    }
+
+    map_size = max_flows;
+    keys = calloc(map_size, sizeof(flow_key_t));
+    values = calloc(map_size, sizeof(flow_value_t));
+    flows = calloc(map_size, sizeof(xdp_flow_t));
+    if (!keys || !values || !flows) {
+        return false;
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_HASH;
+    attr.key_size = sizeof(flow_key_t);
+    attr.value_size = sizeof(flow_value_t);
+    attr.max_entries = map_size;
+    strncpy(attr.map_name, "udp_tunnel", sizeof(attr.map_name) - 1);
+    map_fd = bpf(BPF_MAP_CREATE, &attr);
+    if (map_fd < 0) {
+        return false;
+    }
+
+    int prog_fd = load_program(port);
+    if (prog_fd < 0) {
+        return false;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = generic ? XDP_FLAGS_SKB_MODE : 0;
+    link_fd = bpf(BPF_LINK_CREATE, &attr);
+    close(prog_fd);
+    return (link_fd >= 0);
+}
+
+/**
+ * let the program forward everything coming from one address to another
+ *
+ * @return false if the map is full
+ */
+bool xdp_add(struct sockaddr_in* from, struct sockaddr_in* to) {
+    flow_key_t key = {
+        .addr = from->sin_addr.s_addr,
+        .port = from->sin_port
+    };
+    flow_value_t value = {
+        .addr = to->sin_addr.s_addr,
+        .port = to->sin_port
+    };
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&value;
+    attr.flags = BPF_ANY;
+    return (bpf(BPF_MAP_UPDATE_ELEM, &attr) == 0);
+}
+
+/**
+ * stop forwarding datagrams from an address in the program
+ */
+void xdp_del(struct sockaddr_in* from) {
+    flow_key_t key = {
+        .addr = from->sin_addr.s_addr,
+        .port = from->sin_port
+    };
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uintptr_t)&key;
+    bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/**
+ * read the counters of all flows in the map. The result stays valid
+ * until the next call, only one thread may use this.
+ *
+ * @param result will receive a pointer to the counters
+ * @return number of flows
+ */
+unsigned xdp_read(const xdp_flow_t** result) {
+    uint64_t batch_in = 0;
+    uint64_t batch_out = 0;
+    bool first = true;
+    unsigned n = 0;
+    union bpf_attr attr;
+
+    while (n < map_size) {
+        memset(&attr, 0, sizeof(attr));
+        attr.batch.in_batch = first ? 0 : (uintptr_t)&batch_in;
+        attr.batch.out_batch = (uintptr_t)&batch_out;
+        attr.batch.keys = (uintptr_t)(keys + n);
+        attr.batch.values = (uintptr_t)(values + n);
+        attr.batch.count = map_size - n;
+        attr.batch.map_fd = map_fd;
+        int ret = bpf(BPF_MAP_LOOKUP_BATCH, &attr);
+        n += attr.batch.count;
+        if (ret < 0) {
+            break; // ENOENT when all entries have been read
+        }
+        batch_in = batch_out;
+        first = false;
+    }
+
+    for (unsigned i = 0; i < n; ++i) {
+        memset(&flows[i].from, 0, sizeof(struct sockaddr_in));
+        flows[i].from.sin_family = AF_INET;
+        flows[i].from.sin_addr.s_addr = keys[i].addr;
+        flows[i].from.sin_port = keys[i].port;
+        flows[i].packets = values[i].packets;
+        flows[i].bytes = values[i].bytes;
+    }
+    *result = flows;
+    return n;
+}
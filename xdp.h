@@ -0,0 +1,23 @@
+#ifndef XDP_H
+#define XDP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * counters of a flow forwarded by the XDP program, for the direction
+ * coming from the address from. They only ever grow.
+ */
+typedef struct {
+    struct sockaddr_in from;
+    uint64_t packets;
+    uint64_t bytes;
+} xdp_flow_t;
+
+bool xdp_attach(const char* ifname, uint16_t port, unsigned max_flows, bool generic);
+bool xdp_add(struct sockaddr_in* from, struct sockaddr_in* to);
+void xdp_del(struct sockaddr_in* from);
+unsigned xdp_read(const xdp_flow_t** flows);
+
+#endif